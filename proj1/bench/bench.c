@@ -0,0 +1,350 @@
+// Loopback benchmark of the link layer.
+// Runs a transmitter and a receiver in one process, each in its own thread, over a pair
+// of pseudo terminals. A relay thread between them plays the line: it holds every byte
+// for its serialization time at the baud rate plus the propagation delay, and flips bits
+// at the given bit error rate. Reports throughput, efficiency and CPU time per MB.
+//
+// Usage: bench [-p payload] [-s fileSize] [-b ber] [-d delayMs] [-r baud]
+//              [-w window] [-a sw|gbn|sr] [-f fecParity] [-S seed] [-v]
+// Without -a a window of 1 runs stop-and-wait and a larger one selective repeat.
+
+#define _GNU_SOURCE
+#include "link_layer.h"
+#include <errno.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+// The relay moves the bytes in chunks of up to CHUNK_SIZE, each released when its last
+// byte would have left the line.
+#define CHUNK_SIZE 256
+#define QUEUE_CHUNKS 4096
+
+typedef struct {
+    double due; // ms when the chunk reaches the other end
+    int size;
+    int sent;
+    unsigned char data[CHUNK_SIZE];
+} Chunk;
+
+// One direction of the line
+typedef struct {
+    int from;
+    int to;
+    Chunk* queue;
+    int head;
+    int count;
+    double lineFree;  // ms when the line has sent every byte queued
+    double nextError; // bits before the next error
+    uint64_t random;
+    long bytes;
+    long errors;
+} Direction;
+
+typedef struct {
+    int payload;
+    long fileSize;
+    double ber;
+    double delayMs;
+    int baud; // 0 for a line as fast as the ptys
+    int window;
+    ArqMode arqMode;
+    int fecParity;
+    int verbose;
+    char ports[2][64];
+} Bench;
+
+typedef struct {
+    Bench* bench;
+    const unsigned char* file;
+    int ok;
+    double elapsed; // seconds from the first llwrite / llread to llclose
+    double cpu;     // CPU seconds of the thread
+    LinkStatistics statistics;
+} Side;
+
+volatile int relayDone = FALSE;
+
+double clockMs() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000.0 + now.tv_nsec / 1e6;
+}
+
+double threadCpu() {
+    struct timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// xorshift64*, uniform in (0, 1]
+double nextRandom(uint64_t* state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return ((*state * 2685821657736338717ull >> 11) + 1) / 9007199254740992.0;
+}
+
+// Bits until the next error, geometric with mean 1 / ber.
+double errorGap(Direction* d, double ber) {
+    return ber > 0 ? floor(log(nextRandom(&d->random)) / log1p(-ber)) : INFINITY;
+}
+
+void addNoise(Direction* d, double ber, unsigned char* data, int size) {
+    double bits = size * 8.0;
+    double at = d->nextError;
+    while (at < bits) {
+        data[(int)at / 8] ^= 1 << ((int)at % 8);
+        d->errors++;
+        at += 1 + errorGap(d, ber);
+    }
+    d->nextError = at - bits;
+}
+
+// Reads what the port has into a new chunk. Returns FALSE if the queue is full.
+int readChunk(Direction* d, Bench* bench) {
+    if (d->count == QUEUE_CHUNKS) return FALSE;
+    Chunk* chunk = &d->queue[(d->head + d->count) % QUEUE_CHUNKS];
+    int size = read(d->from, chunk->data, CHUNK_SIZE);
+    if (size <= 0) return TRUE;
+
+    double now = clockMs();
+    if (d->lineFree < now) d->lineFree = now;
+    if (bench->baud > 0) d->lineFree += size * 10 * 1000.0 / bench->baud;
+    chunk->due = d->lineFree + bench->delayMs;
+    chunk->size = size;
+    chunk->sent = 0;
+    addNoise(d, bench->ber, chunk->data, size);
+    d->bytes += size;
+    d->count++;
+    return TRUE;
+}
+
+// Writes the chunks that are due. Returns the ms until the next one, or -1 if none is left.
+int writeChunks(Direction* d) {
+    while (d->count > 0) {
+        Chunk* chunk = &d->queue[d->head];
+        double wait = chunk->due - clockMs();
+        if (wait > 0) return (int)ceil(wait);
+        int bytes = write(d->to, chunk->data + chunk->sent, chunk->size - chunk->sent);
+        if (bytes < 0) return errno == EAGAIN ? 1 : -1;
+        chunk->sent += bytes;
+        if (chunk->sent < chunk->size) return 1;
+        d->head = (d->head + 1) % QUEUE_CHUNKS;
+        d->count--;
+    }
+    return -1;
+}
+
+void* relay(void* arg) {
+    Bench* bench = ((void** )arg)[0];
+    Direction* dirs = ((void** )arg)[1];
+
+    while (!relayDone) {
+        int timeout = 50;
+        for (int i = 0; i < 2; i++) {
+            int wait = writeChunks(&dirs[i]);
+            if (wait >= 0 && wait < timeout) timeout = wait;
+        }
+        struct pollfd fds[2];
+        for (int i = 0; i < 2; i++) {
+            fds[i].fd = dirs[i].from;
+            fds[i].events = dirs[i].count < QUEUE_CHUNKS ? POLLIN : 0;
+        }
+        if (poll(fds, 2, timeout) < 0 && errno != EINTR) break;
+        for (int i = 0; i < 2; i++) {
+            if (fds[i].revents & POLLIN) readChunk(&dirs[i], bench);
+        }
+    }
+    return NULL;
+}
+
+// Opens a pseudo terminal and puts its slave in raw mode before the link layer opens it,
+// so nothing written before then is echoed. The slave stays open to keep its settings.
+int openPty(char* slavePath, int size, int* slaveFd) {
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0 || ptsname_r(master, slavePath, size) != 0) {
+        perror("posix_openpt");
+        return -1;
+    }
+    *slaveFd = open(slavePath, O_RDWR | O_NOCTTY);
+    struct termios tio;
+    if (*slaveFd < 0 || tcgetattr(*slaveFd, &tio) < 0) {
+        perror(slavePath);
+        return -1;
+    }
+    cfmakeraw(&tio);
+    tcsetattr(*slaveFd, TCSANOW, &tio);
+    fcntl(master, F_SETFL, O_NONBLOCK);
+    return master;
+}
+
+LinkLayer linkParameters(Bench* bench, LinkLayerRole role) {
+    LinkLayer linkLayer;
+    memset(&linkLayer, 0, sizeof(linkLayer));
+    strcpy(linkLayer.serialPort, bench->ports[role == LlTx ? 0 : 1]);
+    linkLayer.role = role;
+    // the link layer sizes its timers for the queue at this rate, so a fast line claims the fastest
+    linkLayer.baudRate = bench->baud > 0 ? bench->baud : 230400;
+    linkLayer.nRetransmissions = 10;
+    linkLayer.timeoutMs = 1000 + 4 * (int)bench->delayMs;
+    linkLayer.timeout = linkLayer.timeoutMs / 1000;
+    linkLayer.arqMode = bench->arqMode;
+    linkLayer.windowSize = bench->window;
+    linkLayer.frameCheck = CheckCrc32c;
+    linkLayer.maxFramePayload = bench->payload;
+    linkLayer.fecParity = bench->fecParity;
+    return linkLayer;
+}
+
+void* transmitter(void* arg) {
+    Side* side = (Side* )arg;
+    Bench* bench = side->bench;
+    LinkConnection* conn = llopenConnection(linkParameters(bench, LlTx));
+    if (conn == NULL) return NULL;
+
+    LinkStatistics statistics;
+    llstatisticsConnection(conn, &statistics);
+    int payload = bench->payload < statistics.maxFramePayload ? bench->payload : statistics.maxFramePayload;
+    double start = clockMs();
+    double cpu = threadCpu();
+    side->ok = TRUE;
+    for (long offset = 0; offset < bench->fileSize && side->ok; offset += payload) {
+        int size = bench->fileSize - offset < payload ? bench->fileSize - offset : payload;
+        side->ok = llwriteConnection(conn, side->file + offset, size) > 0;
+    }
+    llstatisticsConnection(conn, &side->statistics);
+    if (llcloseConnection(conn, bench->verbose) < 0) side->ok = FALSE;
+    side->elapsed = (clockMs() - start) / 1000;
+    side->cpu = threadCpu() - cpu;
+    return NULL;
+}
+
+void* receiver(void* arg) {
+    Side* side = (Side* )arg;
+    Bench* bench = side->bench;
+    LinkConnection* conn = llopenConnection(linkParameters(bench, LlRx));
+    if (conn == NULL) return NULL;
+
+    unsigned char* packet = malloc(MAX_LARGE_PAYLOAD_SIZE);
+    long received = 0;
+    int size;
+    double start = clockMs();
+    double cpu = threadCpu();
+    side->ok = TRUE;
+    while ((size = llreadConnection(conn, packet)) > 0) {
+        if (received + size > bench->fileSize || memcmp(packet, side->file + received, size) != 0) side->ok = FALSE;
+        received += size;
+    }
+    if (size < 0 || received != bench->fileSize) side->ok = FALSE;
+    llstatisticsConnection(conn, &side->statistics);
+    llcloseConnection(conn, bench->verbose);
+    side->elapsed = (clockMs() - start) / 1000;
+    side->cpu = threadCpu() - cpu;
+    free(packet);
+    return NULL;
+}
+
+// Names of the ARQ modes for -a, in ArqMode order
+const char* arqNames[] = {"sw", "gbn", "sr"};
+
+// ArqMode called "name", or -1.
+int arqByName(const char* name) {
+    for (int i = 0; i < (int)(sizeof(arqNames) / sizeof(arqNames[0])); i++) {
+        if (!strcmp(name, arqNames[i])) return i;
+    }
+    return -1;
+}
+
+int main(int argc, char* argv[]) {
+    Bench bench = {.payload = 1000, .fileSize = 1000000, .window = DEFAULT_WINDOW_SIZE};
+    uint64_t seed = 1;
+    int arq = -1;
+    int option;
+    while ((option = getopt(argc, argv, "p:s:b:d:r:w:a:f:S:v")) != -1) {
+        switch (option) {
+            case 'p': bench.payload = atoi(optarg); break;
+            case 's': bench.fileSize = atol(optarg); break;
+            case 'b': bench.ber = atof(optarg); break;
+            case 'd': bench.delayMs = atof(optarg); break;
+            case 'r': bench.baud = atoi(optarg); break;
+            case 'w': bench.window = atoi(optarg); break;
+            case 'a':
+                if ((arq = arqByName(optarg)) < 0) {
+                    printf("The ARQ mode must be sw, gbn or sr\n");
+                    exit(1);
+                }
+                break;
+            case 'f': bench.fecParity = atoi(optarg); break;
+            case 'S': seed = strtoull(optarg, NULL, 10); break;
+            case 'v': bench.verbose = TRUE; break;
+            default:
+                printf("Usage: %s [-p payload] [-s fileSize] [-b ber] [-d delayMs] [-r baud] "
+                       "[-w window] [-a sw|gbn|sr] [-f fecParity] [-S seed] [-v]\n", argv[0]);
+                exit(1);
+        }
+    }
+    if (bench.payload < 1 || bench.payload > MAX_LARGE_PAYLOAD_SIZE || bench.fileSize < 0) {
+        printf("The payload must be 1 to %d bytes\n", MAX_LARGE_PAYLOAD_SIZE);
+        exit(1);
+    }
+    if (arq >= 0) bench.arqMode = arq;
+    else bench.arqMode = bench.window > 1 ? ArqSelectiveRepeat : ArqStopAndWait;
+    if (bench.arqMode == ArqStopAndWait) bench.window = 1; // llopen would ignore it
+
+    Direction dirs[2];
+    int slaves[2];
+    memset(dirs, 0, sizeof(dirs));
+    int masters[2];
+    for (int i = 0; i < 2; i++) {
+        if ((masters[i] = openPty(bench.ports[i], sizeof(bench.ports[i]), &slaves[i])) < 0) exit(1);
+    }
+    for (int i = 0; i < 2; i++) {
+        dirs[i].from = masters[i];
+        dirs[i].to = masters[1 - i];
+        dirs[i].queue = malloc(QUEUE_CHUNKS * sizeof(Chunk));
+        dirs[i].random = seed * 2 + i + 1;
+        dirs[i].nextError = errorGap(&dirs[i], bench.ber);
+    }
+
+    unsigned char* file = malloc(bench.fileSize > 0 ? bench.fileSize : 1);
+    uint64_t state = seed + 12345;
+    for (long i = 0; i < bench.fileSize; i++) file[i] = (unsigned char)(nextRandom(&state) * 256);
+
+    Side tx = {.bench = &bench, .file = file};
+    Side rx = {.bench = &bench, .file = file};
+    void* relayArgs[2] = {&bench, dirs};
+    pthread_t relayThread, txThread, rxThread;
+    pthread_create(&relayThread, NULL, relay, relayArgs);
+    pthread_create(&rxThread, NULL, receiver, &rx);
+    pthread_create(&txThread, NULL, transmitter, &tx);
+    pthread_join(txThread, NULL);
+    pthread_join(rxThread, NULL);
+    relayDone = TRUE;
+    pthread_join(relayThread, NULL);
+
+    double throughput = tx.elapsed > 0 ? bench.fileSize / tx.elapsed : 0;
+    double mb = bench.fileSize / 1e6;
+    printf("\nBenchmark: %ld bytes, %d byte payload, %s with window %d, BER %g, delay %g ms\n",
+           bench.fileSize, bench.payload, arqNames[bench.arqMode], bench.window, bench.ber, bench.delayMs);
+    if (bench.baud > 0) printf("  Line: %d baud\n", bench.baud);
+    else printf("  Line: as fast as the ptys\n");
+    printf("  Result: %s\n", tx.ok && rx.ok ? "ok" : "FAILED");
+    printf("  Time: %.3f s, throughput: %.0f bytes/s\n", tx.elapsed, throughput);
+    if (bench.baud > 0) printf("  Efficiency: %.1f%% of %d bytes/s\n", 100 * throughput / (bench.baud / 10.0), bench.baud / 10);
+    printf("  Frames: %ld sent, %ld retransmitted, %ld REJ, %ld timeouts, %ld FEC repairs\n",
+           tx.statistics.framesSent, tx.statistics.retransmissions, tx.statistics.rejReceived,
+           tx.statistics.timeouts, rx.statistics.fecRepaired);
+    printf("  Line errors: %ld bits flipped\n", dirs[0].errors + dirs[1].errors);
+    if (mb > 0) printf("  CPU per MB: transmitter %.1f ms, receiver %.1f ms\n", 1000 * tx.cpu / mb, 1000 * rx.cpu / mb);
+
+    for (int i = 0; i < 2; i++) {
+        close(masters[i]);
+        close(slaves[i]);
+        free(dirs[i].queue);
+    }
+    free(file);
+    return tx.ok && rx.ok ? 0 : 1;
+}
@@ -4,24 +4,47 @@
 // Author: Manuel Ricardo [mricardo@fe.up.pt]
 // Modified by: Eduardo Nuno Almeida [enalmeida@fe.up.pt]
 
+#define _GNU_SOURCE // splice
+#include <errno.h>
 #include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "capture.h"
+
 // Baudrate settings are defined in <asm/termbits.h>, which is
 // included by <termios.h>
 #define BAUDRATE B38400
-#define _POSIX_SOURCE 1 // POSIX compliant source
 #define FALSE 0
 #define TRUE 1
 
 #define BUF_SIZE 2048
 
+// Chunks of data each direction holds while they cross the line
+#define QUEUE_CHUNKS 1024
+// With a baud rate the cable takes SLICE_MS of data at a time, at the pace of the line.
+// What the line has not sent yet waits in the sender's port, as it would in a UART.
+#define SLICE_MS 5
+// Room left in a buffer for the bytes the noise inserts
+#define NOISE_ROOM 256
+// Bit error rate of the "noise" command when no other noise was set
+#define DEFAULT_BER 1e-4
+
+// Scenario files: at most MAX_EVENTS commands of up to COMMAND_SIZE characters
+#define MAX_EVENTS 256
+#define COMMAND_SIZE 64
+// Once the scenario ran its last command, the cable ends after this idle time
+#define DEFAULT_IDLE_S 5
+
 typedef enum
 {
     CableModeOn,
@@ -29,6 +52,95 @@ typedef enum
     CableModeNoise,
 } CableMode;
 
+typedef struct
+{
+    double due; // ms when its last byte reaches the other end
+    int size;
+    int taken; // bytes taken from the port, before the noise dropped or inserted any
+    uint32_t id; // in the capture
+    unsigned char data[BUF_SIZE + NOISE_ROOM];
+} Chunk;
+
+// Noise added to the data in CableModeNoise. Bit errors follow a Gilbert-Elliott model:
+// the line is either good, with "ber", or in a burst, with "burstBer". It enters a burst
+// after "burstGap" bits on average and leaves it after "burstLength" bits on average.
+// Bytes are also lost or inserted, each with its own probability per byte.
+typedef struct
+{
+    double ber;
+    double burstBer;    // 0 for no bursts
+    double burstLength; // mean bits in a burst
+    double burstGap;    // mean bits between bursts
+    double dropRate;
+    double insertRate;
+    uint64_t seed;
+} Noise;
+
+// One direction of the cable. With the cable on the bytes go from "from" to "to" through
+// a pipe with splice(), so they are never copied to this program. They are read into
+// "buf" only when noise has to be added or the cable is off.
+// With a baud rate or a delay the line is timed: each chunk taken occupies the line for
+// its bytes * 10 / baud seconds (8N1) and arrives "delayMs" after its last byte was sent.
+typedef struct
+{
+    int from;
+    int to;
+    int toTx; // the direction from Rx to Tx, for the messages
+    int pipe[2];
+    int pipeBytes; // spliced into the pipe and not out of it yet
+    int useSplice;
+    unsigned char buf[BUF_SIZE + NOISE_ROOM];
+
+    uint64_t random; // state of the noise generator
+    int inBurst;
+    double nextError;  // bits until the next one flipped
+    double nextChange; // bits until a burst starts or ends
+    double nextDrop;   // bytes until the next one dropped
+    double nextInsert; // bytes until the next one inserted
+    long bitErrors;
+    long burstErrors; // bit errors made during bursts
+    long dropped;
+    long inserted;
+
+    long taken;       // bytes read from the port
+    long delivered;   // bytes written to the other end
+    long lost;        // bytes read while the cable was off
+    double firstByte; // ms when the first and the last bytes were read, 0 if none was
+    double lastByte;
+
+    int baud;        // bits per second, 0 for no limit
+    double lineFree; // ms when the line has sent every byte taken so far
+    Chunk *queue;    // chunks on their way, oldest first
+    int head;
+    int count;
+} Direction;
+
+typedef struct
+{
+    CableMode mode;
+    double delayMs; // one-way propagation delay
+    Noise noise;
+    Direction tx2rx;
+    Direction rx2tx;
+    FILE *capture; // NULL if not capturing
+    uint32_t chunks;
+} Cable;
+
+// A command of a scenario, run "at" ms after the first byte reached the cable.
+typedef struct
+{
+    double at;
+    char command[COMMAND_SIZE];
+} Event;
+
+// Timeline of commands read from a scenario file, in the order they run.
+typedef struct
+{
+    Event events[MAX_EVENTS];
+    int count;
+    int next;
+} Scenario;
+
 // Returns: serial port file descriptor (fd).
 int openSerialPort(const char *serialPort, struct termios *oldtio, struct termios *newtio)
 {
@@ -56,14 +168,670 @@ int openSerialPort(const char *serialPort, struct termios *oldtio, struct termio
     return fd;
 }
 
-// Add noise to a buffer, by flipping the byte in the "errorIndex" position.
-void addNoiseToBuffer(unsigned char *buf, size_t errorIndex)
+double nowMs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000.0 + now.tv_nsec / 1e6;
+}
+
+// Appends a record to the capture, if there is one.
+void captureRecord(Cable *cable, CaptureKind kind, Direction *d, uint32_t chunk, const void *data, int size)
+{
+    if (cable->capture == NULL)
+        return;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    CaptureRecord record;
+    memset(&record, 0, sizeof(record));
+    record.timeNs = now.tv_sec * 1000000000ull + now.tv_nsec;
+    record.chunk = chunk;
+    record.size = size;
+    record.kind = kind;
+    record.direction = d == &cable->rx2tx;
+    fwrite(&record, sizeof(record), 1, cable->capture);
+    fwrite(data, 1, size, cable->capture);
+}
+
+// Starts a capture in "path", recording the line settings it starts with.
+// Returns 0, or -1 if the file cannot be written.
+int startCapture(Cable *cable, const char *path)
+{
+    cable->capture = fopen(path, "wb");
+    if (cable->capture == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+    setvbuf(cable->capture, NULL, _IOFBF, 1 << 20);
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    CaptureHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC));
+    header.version = CAPTURE_VERSION;
+    header.startNs = now.tv_sec * 1000000000ull + now.tv_nsec;
+    fwrite(&header, sizeof(header), 1, cable->capture);
+
+    char settings[4][64];
+    snprintf(settings[0], sizeof(settings[0]), "baud %d %d", cable->tx2rx.baud, cable->rx2tx.baud);
+    snprintf(settings[1], sizeof(settings[1]), "delay %g", cable->delayMs);
+    snprintf(settings[2], sizeof(settings[2]), "seed %llu", (unsigned long long)cable->noise.seed);
+    snprintf(settings[3], sizeof(settings[3]), "%s", cable->mode == CableModeNoise ? "noise" : "on");
+    for (int i = 0; i < 4; i++)
+        captureRecord(cable, CaptureCommand, &cable->tx2rx, 0, settings[i], strlen(settings[i]));
+    return 0;
+}
+
+// The direction has to be timed: it has a baud rate, a delay or chunks still on the way.
+int isTimed(Cable *cable, Direction *d)
+{
+    return d->baud > 0 || cable->delayMs > 0 || d->count > 0;
+}
+
+// Bytes the line sends in SLICE_MS.
+int sliceBytes(int baud)
+{
+    int bytes = baud / 10 * SLICE_MS / 1000;
+    return bytes < 1 ? 1 : bytes > BUF_SIZE ? BUF_SIZE : bytes;
+}
+
+// xorshift64*, uniform in (0, 1]
+double nextRandom(uint64_t *state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return ((*state * 2685821657736338717ull >> 11) + 1) / 9007199254740992.0;
+}
+
+// Trials until the next event of probability "p", geometric. INFINITY if "p" is 0.
+// Drawing the gaps makes the noise cost per error instead of per bit.
+double eventGap(uint64_t *state, double p)
+{
+    if (p <= 0)
+        return INFINITY;
+    if (p >= 1)
+        return 0;
+    return floor(log(nextRandom(state)) / log1p(-p));
+}
+
+// Probability per bit of entering or leaving a burst.
+double burstChange(Direction *d, Noise *noise)
+{
+    if (noise->burstBer <= 0)
+        return 0;
+    return 1 / (d->inBurst ? noise->burstLength : noise->burstGap);
+}
+
+// Draws the gaps to the next events again, after the noise settings changed.
+void drawGaps(Cable *cable)
+{
+    Noise *noise = &cable->noise;
+    Direction *directions[2] = {&cable->tx2rx, &cable->rx2tx};
+    for (int i = 0; i < 2; i++)
+    {
+        Direction *d = directions[i];
+        if (noise->burstBer <= 0)
+            d->inBurst = FALSE;
+        d->nextError = eventGap(&d->random, d->inBurst ? noise->burstBer : noise->ber);
+        d->nextChange = eventGap(&d->random, burstChange(d, noise));
+        d->nextDrop = eventGap(&d->random, noise->dropRate);
+        d->nextInsert = eventGap(&d->random, noise->insertRate);
+    }
+}
+
+// Restarts the generators of both directions from "seed", so that a run can be repeated.
+void seedNoise(Cable *cable, uint64_t seed)
+{
+    Direction *directions[2] = {&cable->tx2rx, &cable->rx2tx};
+    cable->noise.seed = seed;
+    for (int i = 0; i < 2; i++)
+    {
+        // splitmix64 of the seed and the direction, never 0
+        uint64_t z = seed + (i + 1) * 0x9E3779B97F4A7C15ull;
+        z = (z ^ z >> 30) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ z >> 27) * 0x94D049BB133111EBull;
+        directions[i]->random = (z ^ z >> 31) | 1;
+        directions[i]->inBurst = FALSE;
+    }
+    drawGaps(cable);
+}
+
+// Flips the bits of "data" the line gets wrong. The gaps carry over from one buffer to
+// the next, so the errors depend on the bytes sent and the seed, not on how they were read.
+void addBitErrors(Direction *d, Noise *noise, unsigned char *data, int size)
+{
+    double bits = size * 8.0;
+    double at = 0;
+    for (;;)
+    {
+        double error = at + d->nextError;
+        double change = at + d->nextChange;
+        if (error >= bits && change >= bits)
+        {
+            d->nextError -= bits - at;
+            d->nextChange -= bits - at;
+            return;
+        }
+        if (error < change)
+        {
+            data[(long)error / 8] ^= 1 << ((long)error % 8);
+            d->bitErrors++;
+            if (d->inBurst)
+                d->burstErrors++;
+            d->nextChange -= error + 1 - at;
+            at = error + 1;
+        }
+        else
+        {
+            d->inBurst = !d->inBurst;
+            d->nextChange = eventGap(&d->random, burstChange(d, noise));
+            at = change + 1;
+        }
+        d->nextError = eventGap(&d->random, d->inBurst ? noise->burstBer : noise->ber);
+    }
+}
+
+// Drops and inserts bytes of "data" as the line loses or invents them.
+// Returns the new size, at most "capacity".
+int dropInsertBytes(Direction *d, Noise *noise, unsigned char *data, int size, int capacity)
+{
+    unsigned char in[BUF_SIZE + NOISE_ROOM];
+    int out = 0;
+    memcpy(in, data, size);
+    for (int i = 0; i < size; i++)
+    {
+        if (--d->nextDrop < 0)
+        {
+            d->nextDrop = eventGap(&d->random, noise->dropRate);
+            d->dropped++;
+            continue;
+        }
+        data[out++] = in[i];
+        if (--d->nextInsert < 0)
+        {
+            d->nextInsert = eventGap(&d->random, noise->insertRate);
+            if (out < capacity)
+            {
+                data[out++] = (int)(nextRandom(&d->random) * 256) & 0xFF;
+                d->inserted++;
+            }
+        }
+    }
+    return out;
+}
+
+// Adds the noise to the "size" bytes in "data". Returns the new size.
+int addNoise(Direction *d, Noise *noise, unsigned char *data, int size, int capacity)
+{
+    if (noise->ber > 0 || noise->burstBer > 0)
+        addBitErrors(d, noise, data, size);
+    if (noise->dropRate > 0 || noise->insertRate > 0)
+        size = dropInsertBytes(d, noise, data, size, capacity);
+    return size;
+}
+
+// Counts the bytes read from the port of "d".
+void takeBytes(Direction *d, int bytes)
+{
+    d->lastByte = nowMs();
+    if (d->firstByte == 0)
+        d->firstByte = d->lastByte;
+    d->taken += bytes;
+}
+
+// Prints a transfer and counts the bytes delivered, or lost if "bytesTo" is negative.
+void printTransfer(Direction *d, int bytesFrom, int bytesTo)
+{
+    if (bytesTo < 0)
+        d->lost += bytesFrom;
+    else
+        d->delivered += bytesTo;
+
+    if (d->toTx)
+    {
+        if (bytesTo < 0)
+            printf("bytesToTx=CONNECTION OFF < bytesFromRx=%d\n", bytesFrom);
+        else
+            printf("bytesToTx=%d < bytesFromRx=%d\n", bytesTo, bytesFrom);
+    }
+    else
+    {
+        if (bytesTo < 0)
+            printf("bytesFromTx=%d > bytesToRx=CONNECTION OFF\n", bytesFrom);
+        else
+            printf("bytesFromTx=%d > bytesToRx=%d\n", bytesFrom, bytesTo);
+    }
+}
+
+// Writes all "size" bytes, waiting for the other end to take them.
+int writeAll(int fd, const unsigned char *buf, int size)
+{
+    int written = 0;
+    while (written < size)
+    {
+        int bytes = write(fd, buf + written, size - written);
+        if (bytes < 0 && errno == EINTR)
+            continue;
+        if (bytes <= 0)
+            return written > 0 ? written : bytes;
+        written += bytes;
+    }
+    return written;
+}
+
+// Moves what the port has through the pipe. Returns the bytes moved, 0 if there were
+// none, or -1 if splice() does not work on these files, so the caller copies instead.
+int forwardSplice(Direction *d)
+{
+    int bytesFrom = 0;
+    if (d->pipeBytes == 0)
+    {
+        bytesFrom = splice(d->from, NULL, d->pipe[1], NULL, BUF_SIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (bytesFrom < 0)
+            return errno == EAGAIN || errno == EINTR ? 0 : -1;
+        d->pipeBytes = bytesFrom;
+        if (bytesFrom > 0)
+            takeBytes(d, bytesFrom);
+    }
+
+    int bytesTo = 0;
+    while (d->pipeBytes > 0)
+    {
+        int bytes = splice(d->pipe[0], NULL, d->to, NULL, d->pipeBytes, SPLICE_F_MOVE);
+        if (bytes < 0 && errno == EINTR)
+            continue;
+        if (bytes <= 0)
+        {
+            perror("splice");
+            break;
+        }
+        d->pipeBytes -= bytes;
+        bytesTo += bytes;
+    }
+    if (bytesFrom > 0)
+        printTransfer(d, bytesFrom, bytesTo);
+    return bytesFrom;
+}
+
+// Forwards what the port has to the other end, according to the cable mode.
+// On a timed line the data is queued until it is due.
+void forward(Direction *d, Cable *cable)
+{
+    int timed = isTimed(cable, d);
+    // a capture needs the bytes here, spliced ones never are
+    if (cable->mode == CableModeOn && d->useSplice && !timed && cable->capture == NULL)
+    {
+        if (forwardSplice(d) >= 0)
+            return;
+        d->useSplice = FALSE;
+        printf("splice() not available, copying the data\n");
+    }
+
+    Chunk *chunk = &d->queue[(d->head + d->count) % QUEUE_CHUNKS];
+    unsigned char *buf = timed ? chunk->data : d->buf;
+    int bytesFrom = read(d->from, buf, d->baud > 0 ? sliceBytes(d->baud) : BUF_SIZE);
+    if (bytesFrom <= 0)
+        return;
+    takeBytes(d, bytesFrom);
+    uint32_t id = ++cable->chunks;
+    captureRecord(cable, CaptureTaken, d, id, buf, bytesFrom);
+
+    if (timed)
+    {
+        double now = nowMs();
+        if (d->lineFree < now)
+            d->lineFree = now;
+        if (d->baud > 0)
+            d->lineFree += bytesFrom * 10 * 1000.0 / d->baud;
+    }
+    if (cable->mode == CableModeOff)
+    {
+        printTransfer(d, bytesFrom, -1);
+        captureRecord(cable, CaptureLost, d, id, NULL, 0);
+        return;
+    }
+    int size = bytesFrom;
+    if (cable->mode == CableModeNoise)
+        size = addNoise(d, &cable->noise, buf, bytesFrom, BUF_SIZE + NOISE_ROOM);
+    if (!timed)
+    {
+        printTransfer(d, bytesFrom, writeAll(d->to, buf, size));
+        captureRecord(cable, CaptureDelivered, d, id, buf, size);
+        return;
+    }
+    chunk->size = size;
+    chunk->taken = bytesFrom;
+    chunk->id = id;
+    chunk->due = d->lineFree + cable->delayMs;
+    d->count++;
+}
+
+// Writes the chunks that arrived. Returns the ms until the next one does, or -1 if none is left.
+int deliverChunks(Direction *d, Cable *cable, double now)
+{
+    while (d->count > 0)
+    {
+        Chunk *chunk = &d->queue[d->head];
+        if (chunk->due > now)
+            return (int)ceil(chunk->due - now);
+        printTransfer(d, chunk->taken, writeAll(d->to, chunk->data, chunk->size));
+        captureRecord(cable, CaptureDelivered, d, chunk->id, chunk->data, chunk->size);
+        d->head = (d->head + 1) % QUEUE_CHUNKS;
+        d->count--;
+    }
+    return -1;
+}
+
+void printLine(Cable *cable)
+{
+    for (int i = 0; i < 2; i++)
+    {
+        Direction *d = i == 0 ? &cable->tx2rx : &cable->rx2tx;
+        printf("%s: ", i == 0 ? "Tx > Rx" : "Rx > Tx");
+        if (d->baud > 0)
+            printf("%d baud, ", d->baud);
+        else
+            printf("no baud limit, ");
+    }
+    printf("delay %g ms\n", cable->delayMs);
+}
+
+void printNoise(Cable *cable)
+{
+    Noise *noise = &cable->noise;
+    printf("Noise: BER %g", noise->ber);
+    if (noise->burstBer > 0)
+        printf(", bursts of BER %g, %g bits every %g bits", noise->burstBer, noise->burstLength, noise->burstGap);
+    printf(", drop %g, insert %g per byte, seed %llu\n", noise->dropRate, noise->insertRate,
+           (unsigned long long)noise->seed);
+    for (int i = 0; i < 2; i++)
+    {
+        Direction *d = i == 0 ? &cable->tx2rx : &cable->rx2tx;
+        printf("%s: %ld bit errors (%ld in bursts), %ld bytes dropped, %ld inserted\n",
+               i == 0 ? "Tx > Rx" : "Rx > Tx", d->bitErrors, d->burstErrors, d->dropped, d->inserted);
+    }
+}
+
+// ms when the first byte reached the cable, in either direction. 0 if none did.
+double cableStart(Cable *cable)
 {
-    buf[errorIndex] ^= 0xFF;
+    double tx = cable->tx2rx.firstByte;
+    double rx = cable->rx2tx.firstByte;
+    if (tx == 0 || (rx > 0 && rx < tx))
+        return rx;
+    return tx;
+}
+
+// Prints what crossed the cable, for the end of a run.
+void printSummary(Cable *cable)
+{
+    printf("\nSummary\n");
+    for (int i = 0; i < 2; i++)
+    {
+        Direction *d = i == 0 ? &cable->tx2rx : &cable->rx2tx;
+        double seconds = (d->lastByte - d->firstByte) / 1000;
+        printf("%s: %ld bytes taken, %ld delivered, %ld lost while off", i == 0 ? "Tx > Rx" : "Rx > Tx",
+               d->taken, d->delivered, d->lost);
+        if (seconds > 0)
+            printf(", %.0f bytes/s over %.3f s", d->delivered / seconds, seconds);
+        printf("\n");
+    }
+    printLine(cable);
+    printNoise(cable);
+}
+
+// Switches the noise on after one of its settings changed.
+void setNoise(Cable *cable)
+{
+    printf("CONNECTION NOISE\n");
+    cable->mode = CableModeNoise;
+    drawGaps(cable);
+    printNoise(cable);
+}
+
+// Acts on a command typed on stdin. Returns FALSE on "end".
+int handleCommand(char *command, Cable *cable)
+{
+    CableMode *cableMode = &cable->mode;
+    int baud;
+    int baudRx;
+    double delay;
+    double rate;
+    double length;
+    double gap;
+    unsigned long long seed;
+    command[strcspn(command, "\r\n")] = '\0';
+    if (command[0] != '\0')
+        captureRecord(cable, CaptureCommand, &cable->tx2rx, 0, command, strlen(command));
+    int bauds = sscanf(command, "baud %d %d", &baud, &baudRx);
+    int bursts = sscanf(command, "burst %lf %lf %lf", &rate, &length, &gap);
+
+    if (strcmp(command, "off") == 0 || strcmp(command, "0") == 0)
+    {
+        printf("CONNECTION OFF\n");
+        *cableMode = CableModeOff;
+    }
+    else if (strcmp(command, "on") == 0 || strcmp(command, "1") == 0)
+    {
+        printf("CONNECTION ON\n");
+        *cableMode = CableModeOn;
+    }
+    else if (strcmp(command, "noise") == 0 || strcmp(command, "2") == 0)
+    {
+        Noise *noise = &cable->noise;
+        if (noise->ber <= 0 && noise->burstBer <= 0 && noise->dropRate <= 0 && noise->insertRate <= 0)
+            noise->ber = DEFAULT_BER;
+        setNoise(cable);
+    }
+    else if (sscanf(command, "ber %lf", &rate) == 1 && rate >= 0 && rate <= 1)
+    {
+        cable->noise.ber = rate;
+        setNoise(cable);
+    }
+    else if (bursts >= 1 && rate >= 0 && rate <= 1)
+    {
+        // the length and the gap keep their values when not given
+        cable->noise.burstBer = rate;
+        if (bursts >= 2 && length >= 1)
+            cable->noise.burstLength = length;
+        if (bursts == 3 && gap >= 1)
+            cable->noise.burstGap = gap;
+        setNoise(cable);
+    }
+    else if (sscanf(command, "drop %lf", &rate) == 1 && rate >= 0 && rate <= 1)
+    {
+        cable->noise.dropRate = rate;
+        setNoise(cable);
+    }
+    else if (sscanf(command, "insert %lf", &rate) == 1 && rate >= 0 && rate <= 1)
+    {
+        cable->noise.insertRate = rate;
+        setNoise(cable);
+    }
+    else if (sscanf(command, "seed %llu", &seed) == 1)
+    {
+        seedNoise(cable, seed);
+        printNoise(cable);
+    }
+    else if (strcmp(command, "stats") == 0)
+    {
+        printLine(cable);
+        printNoise(cable);
+    }
+    else if (bauds >= 1 && baud >= 0)
+    {
+        // a second value gives the Rx > Tx direction a rate of its own
+        cable->tx2rx.baud = baud;
+        cable->rx2tx.baud = bauds == 2 && baudRx >= 0 ? baudRx : baud;
+        printLine(cable);
+    }
+    else if (sscanf(command, "delay %lf", &delay) == 1 && delay >= 0)
+    {
+        cable->delayMs = delay;
+        printLine(cable);
+    }
+    else if (strcmp(command, "end") == 0)
+    {
+        printf("END OF THE PROGRAM\n");
+        return FALSE;
+    }
+    else if (command[0] != '\0')
+        printf("Unknown command: %s\n", command);
+    return TRUE;
 }
 
+// Reads a scenario file: "t=TIME COMMAND" items separated by ';' or new lines, with TIME
+// in seconds, or in ms with an "ms" suffix. '#' starts a comment.
+// Returns 0, or -1 after printing what is wrong.
+int loadScenario(const char *path, Scenario *scenario)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+
+    char line[BUF_SIZE];
+    int lineNumber = 0;
+    scenario->count = 0;
+    scenario->next = 0;
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        lineNumber++;
+        line[strcspn(line, "#\r\n")] = '\0';
+        char *save;
+        for (char *item = strtok_r(line, ";", &save); item != NULL; item = strtok_r(NULL, ";", &save))
+        {
+            item += strspn(item, " \t");
+            int length = strlen(item);
+            while (length > 0 && (item[length - 1] == ' ' || item[length - 1] == '\t'))
+                item[--length] = '\0';
+            if (length == 0)
+                continue;
+
+            char *end = item;
+            double at = strncmp(item, "t=", 2) == 0 ? strtod(item + 2, &end) : -1;
+            if (strncmp(end, "ms", 2) == 0)
+                end += 2;
+            else
+            {
+                at *= 1000;
+                if (*end == 's')
+                    end++;
+            }
+            char *command = end + strspn(end, " \t");
+            if (end == item || at < 0 || command == end || strlen(command) >= COMMAND_SIZE)
+            {
+                printf("%s:%d: expected \"t=TIME COMMAND\", got \"%s\"\n", path, lineNumber, item);
+                fclose(file);
+                return -1;
+            }
+            if (scenario->count == MAX_EVENTS)
+            {
+                printf("%s:%d: more than %d commands\n", path, lineNumber, MAX_EVENTS);
+                fclose(file);
+                return -1;
+            }
+
+            // keep the events sorted by time, in file order for the same time
+            int i = scenario->count++;
+            for (; i > 0 && scenario->events[i - 1].at > at; i--)
+                scenario->events[i] = scenario->events[i - 1];
+            scenario->events[i].at = at;
+            strcpy(scenario->events[i].command, command);
+        }
+    }
+    fclose(file);
+    return 0;
+}
+
+// Runs the commands of the scenario that are due. The time starts with the first byte
+// that reaches the cable; before it only the commands at t=0 run.
+// Returns FALSE after "end". "*wait" gets the ms until the next command, or -1.
+int runScenario(Scenario *scenario, Cable *cable, double now, int *wait)
+{
+    double start = cableStart(cable);
+    double elapsed = start > 0 ? now - start : 0;
+    *wait = -1;
+    while (scenario->next < scenario->count)
+    {
+        Event *event = &scenario->events[scenario->next];
+        if (event->at > elapsed)
+        {
+            if (start > 0)
+                *wait = (int)ceil(event->at - elapsed);
+            return TRUE;
+        }
+        scenario->next++;
+        printf("[%.3f s] %s\n", event->at / 1000, event->command);
+        if (!handleCommand(event->command, cable))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+// Arguments (all optional):
+//   -b baud: rate of both directions, bits per second (no limit by default)
+//   -r baud: rate of the Rx > Tx direction, if it differs
+//   -d ms: one-way propagation delay
+//   -e ber: start with noise, at this bit error rate
+//   -S seed: seed of the noise generators (1 by default)
+//   -s file: run the commands of a scenario file, unattended
+//   -c file: capture the traffic of both directions in "file", see capture.h
+//   -i seconds: with a scenario, end after the line was idle this long once its last
+//      command ran (DEFAULT_IDLE_S by default)
 int main(int argc, char *argv[])
 {
+    Cable cable;
+    memset(&cable, 0, sizeof(cable));
+    cable.noise.burstLength = 100;
+    cable.noise.burstGap = 1e6;
+    cable.mode = CableModeOn;
+    uint64_t seed = 1;
+    int rxBaud = -1;
+    Scenario *scenario = NULL;
+    double idleMs = DEFAULT_IDLE_S * 1000;
+    const char *capturePath = NULL;
+    int option;
+    while ((option = getopt(argc, argv, "b:r:d:e:S:s:i:c:")) != -1)
+    {
+        if (option == 'b')
+            cable.tx2rx.baud = atoi(optarg);
+        else if (option == 'r')
+            rxBaud = atoi(optarg);
+        else if (option == 'd')
+            cable.delayMs = atof(optarg);
+        else if (option == 'e')
+        {
+            cable.noise.ber = atof(optarg);
+            cable.mode = CableModeNoise;
+        }
+        else if (option == 'S')
+            seed = strtoull(optarg, NULL, 0);
+        else if (option == 's')
+        {
+            scenario = malloc(sizeof(Scenario));
+            if (scenario == NULL || loadScenario(optarg, scenario) < 0)
+                exit(1);
+        }
+        else if (option == 'i')
+            idleMs = atof(optarg) * 1000;
+        else if (option == 'c')
+            capturePath = optarg;
+        else
+        {
+            printf("Usage: %s [-b baud] [-r baud Rx > Tx] [-d delay ms] [-e ber] [-S seed] "
+                   "[-s scenario] [-i idle seconds] [-c capture]\n",
+                   argv[0]);
+            exit(1);
+        }
+    }
+    cable.rx2tx.baud = rxBaud >= 0 ? rxBaud : cable.tx2rx.baud;
+
     printf("\n");
 
     system("socat -dd PTY,link=/dev/ttyS10,mode=777 PTY,link=/dev/emulatorTx,mode=777 &");
@@ -80,9 +848,17 @@ int main(int argc, char *argv[])
            "The cable program is sensible to the following interactive commands:\n"
            "--- on           : connect the cable and data is exchanged (default state)\n"
            "--- off          : disconnect the cable disabling data to be exchanged\n"
-           "--- noise        : add fixed noise to the cable\n"
+           "--- noise        : add noise to the cable (BER %g unless set below)\n"
+           "--- ber P        : P bit error rate\n"
+           "--- burst P [L [G]] : bursts of P bit error rate, L bits long every G bits on average\n"
+           "--- drop P       : P probability of losing each byte\n"
+           "--- insert P     : P probability of a spurious byte after each byte\n"
+           "--- seed N       : restart the noise generators from N\n"
+           "--- stats        : print the line settings and the noise added so far\n"
+           "--- baud B [R]   : B bits per second, R from Rx to Tx if given (0 for no limit)\n"
+           "--- delay D      : D ms of propagation delay\n"
            "--- end          : terminate the program\n"
-           "\n");
+           "\n", DEFAULT_BER);
 
     // Configure serial ports
     struct termios oldtioTx;
@@ -107,92 +883,131 @@ int main(int argc, char *argv[])
         exit(-1);
     }
 
-    // Configure stdin to receive commands to this program
-    int oldf = fcntl(STDIN_FILENO, F_GETFL, 0);
-    fcntl(STDIN_FILENO, F_SETFL, oldf | O_NONBLOCK);
+    Direction *directions[2] = {&cable.tx2rx, &cable.rx2tx};
+    for (int i = 0; i < 2; i++)
+    {
+        Direction *d = directions[i];
+        d->from = i == 0 ? fdTx : fdRx;
+        d->to = i == 0 ? fdRx : fdTx;
+        d->toTx = i == 1;
+        d->useSplice = TRUE;
+        d->queue = malloc(QUEUE_CHUNKS * sizeof(Chunk));
+        if (pipe(d->pipe) < 0 || d->queue == NULL)
+        {
+            perror("pipe");
+            exit(-1);
+        }
+    }
 
-    unsigned char tx2rx[BUF_SIZE] = {0};
-    unsigned char rx2tx[BUF_SIZE] = {0};
     char rxStdin[BUF_SIZE] = {0};
-
-    CableMode cableMode = CableModeOn;
     volatile int STOP = FALSE;
+    seedNoise(&cable, seed);
+    if (capturePath != NULL && startCapture(&cable, capturePath) < 0)
+        exit(-1);
 
+    printLine(&cable);
+    printNoise(&cable);
+    if (scenario != NULL)
+        printf("Scenario of %d commands, timed from the first byte\n", scenario->count);
     printf("Cable ready\n");
 
+    // Sleep until a port or stdin has something, or the line can take or deliver more
+    struct pollfd fds[3] = {{fdTx, POLLIN, 0}, {fdRx, POLLIN, 0}, {STDIN_FILENO, POLLIN, 0}};
+
     while (STOP == FALSE)
     {
-        // Read from Tx
-        int bytesFromTx = read(fdTx, tx2rx, BUF_SIZE);
-
-        if (bytesFromTx > 0)
+        double now = nowMs();
+        int timeout = -1;
+        if (scenario != NULL && !runScenario(scenario, &cable, now, &timeout))
+            break;
+        for (int i = 0; i < 2; i++)
         {
-            if (cableMode == CableModeOff)
-            {
-                printf("bytesFromTx=%d > bytesToRx=CONNECTION OFF\n", bytesFromTx);
-            }
-            else
+            Direction *d = directions[i];
+            int wait = deliverChunks(d, &cable, now);
+            fds[i].events = POLLIN;
+            if (isTimed(&cable, d))
             {
-                if (cableMode == CableModeNoise)
+                if (d->count == QUEUE_CHUNKS)
+                    fds[i].events = 0;
+                else if (d->lineFree > now)
                 {
-                    addNoiseToBuffer(tx2rx, 0);
+                    // still sending the last chunk taken
+                    fds[i].events = 0;
+                    int busy = (int)ceil(d->lineFree - now);
+                    if (wait < 0 || busy < wait)
+                        wait = busy;
                 }
-
-                int bytesToRx = write(fdRx, tx2rx, bytesFromTx);
-                printf("bytesFromTx=%d > bytesToRx=%d\n", bytesFromTx, bytesToRx);
             }
+            if (wait >= 0 && (timeout < 0 || wait < timeout))
+                timeout = wait;
         }
 
-        // Read from Rx
-        int bytesFromRx = read(fdRx, rx2tx, BUF_SIZE);
-
-        if (bytesFromRx > 0)
+        // once the scenario ran its last command, it ends when the line stays quiet
+        if (scenario != NULL && scenario->next == scenario->count && cable.tx2rx.count + cable.rx2tx.count == 0)
         {
-            if (cableMode == CableModeOff)
+            double last = cable.tx2rx.lastByte > cable.rx2tx.lastByte ? cable.tx2rx.lastByte : cable.rx2tx.lastByte;
+            if (last > 0)
             {
-                printf("bytesToTx=CONNECTION OFF < bytesFromRx=%d\n", bytesFromRx);
-            }
-            else
-            {
-                if (cableMode == CableModeNoise)
+                int idle = (int)ceil(last + idleMs - now);
+                if (idle <= 0)
                 {
-                    addNoiseToBuffer(rx2tx, 0);
+                    printf("Line idle for %g s, end of the scenario\n", idleMs / 1000);
+                    break;
                 }
-
-                int bytesToTx = write(fdTx, rx2tx, bytesFromRx);
-                printf("bytesToTx=%d < bytesFromRx=%d\n", bytesToTx, bytesFromRx);
+                if (timeout < 0 || idle < timeout)
+                    timeout = idle;
             }
         }
 
-        // Read commands from STDIN to control the cable mode
-        int fromStdin = read(STDIN_FILENO, rxStdin, BUF_SIZE);
-        if (fromStdin > 0)
+        if (poll(fds, 3, timeout) < 0)
         {
-            rxStdin[fromStdin - 1] = '\0';
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            break;
+        }
 
-            if (strcmp(rxStdin, "off") == 0 || strcmp(rxStdin, "0") == 0)
-            {
-                printf("CONNECTION OFF\n");
-                cableMode = CableModeOff;
-            }
-            else if (strcmp(rxStdin, "on") == 0 || strcmp(rxStdin, "1") == 0)
-            {
-                printf("CONNECTION ON\n");
-                cableMode = CableModeOn;
-            }
-            else if (strcmp(rxStdin, "noise") == 0 || strcmp(rxStdin, "2") == 0)
+        for (int i = 0; i < 2; i++)
+        {
+            if (fds[i].revents & POLLIN)
+                forward(directions[i], &cable);
+            else if (fds[i].revents & (POLLERR | POLLNVAL))
             {
-                printf("CONNECTION NOISE\n");
-                cableMode = CableModeNoise;
+                printf("Serial port error\n");
+                STOP = TRUE;
             }
-            else if (strcmp(rxStdin, "end") == 0)
+        }
+
+        // Read commands from STDIN to control the cable mode
+        if (fds[2].revents & (POLLIN | POLLHUP))
+        {
+            int fromStdin = read(STDIN_FILENO, rxStdin, BUF_SIZE - 1);
+            if (fromStdin > 0)
             {
-                printf("END OF THE PROGRAM\n");
-                STOP = TRUE;
+                rxStdin[fromStdin] = '\0';
+                char *save;
+                for (char *line = strtok_r(rxStdin, "\n", &save); line != NULL; line = strtok_r(NULL, "\n", &save))
+                {
+                    if (!handleCommand(line, &cable))
+                        STOP = TRUE;
+                }
             }
+            else
+                fds[2].fd = -1; // no more commands
         }
     }
 
+    for (int i = 0; i < 2; i++)
+    {
+        close(directions[i]->pipe[0]);
+        close(directions[i]->pipe[1]);
+        free(directions[i]->queue);
+    }
+    free(scenario);
+    printSummary(&cable);
+    if (cable.capture != NULL)
+        fclose(cable.capture);
+
     // Restore the old port settings
     if (tcsetattr(fdRx, TCSANOW, &oldtioRx) == -1)
     {
@@ -209,6 +1024,7 @@ int main(int argc, char *argv[])
     close(fdTx);
     close(fdRx);
 
+    fflush(stdout);
     system("killall socat");
 
     return 0;
@@ -0,0 +1,44 @@
+// Capture file written by the cable (-c) and read by the decoder.
+// A CaptureHeader, then records in time order: a CaptureRecord and "size" bytes of data.
+// Numbers are in the byte order of the machine that wrote the file.
+//
+// Every chunk of bytes the cable reads from a port gets a CaptureTaken record with the
+// bytes as the sender wrote them. A CaptureDelivered record with the same chunk has the
+// bytes written to the other end, after the noise; a CaptureLost one means the cable was
+// off. Their difference is the noise the cable injected.
+
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+#include <stdint.h>
+
+#define CAPTURE_MAGIC "RCOMCAP"
+#define CAPTURE_VERSION 1
+
+typedef enum
+{
+    CaptureTaken,
+    CaptureDelivered,
+    CaptureLost,
+    CaptureCommand, // a cable command, as text
+} CaptureKind;
+
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t startNs; // CLOCK_MONOTONIC when the capture started
+} CaptureHeader;
+
+typedef struct
+{
+    uint64_t timeNs; // CLOCK_MONOTONIC
+    uint32_t chunk;  // chunk of Taken, Delivered and Lost records, from 1
+    uint32_t size;   // bytes of data after the record
+    uint8_t kind;
+    uint8_t direction; // 0 from Tx to Rx, 1 from Rx to Tx
+    uint8_t reserved[6];
+} CaptureRecord;
+
+#endif // _CAPTURE_H_
@@ -0,0 +1,555 @@
+// Offline decoder of the captures of the virtual cable (cable -c file).
+// Rebuilds the frames each side sent from the bytes the cable took from its port, and
+// reports when they crossed, what the noise did to them, the round trip of every I-frame,
+// the gaps before retransmissions and the time the line stood idle.
+//
+// Usage: decode [-q] [-g ms] capture
+//   -q: only the summary, without the timeline of frames
+//   -g ms: smallest idle gap reported (100 ms by default)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "capture.h"
+
+#define FALSE 0
+#define TRUE 1
+
+// Frame bytes, from the link layer
+#define FLAG 0x7E
+#define ESC 0x7D
+#define C_SET 0x03
+#define C_UA 0x07
+#define C_DISC 0x0B
+#define C_IX 0x20
+#define C_RRX 0x25
+#define C_REJX 0x21
+#define C_SREJX 0x2D
+#define C_IXA 0x22
+
+// Largest frame kept, after unstuffing: the largest I-frame with its check and FEC parity
+#define MAX_FRAME 70000
+#define SEQ_SPACE 256
+#define DEFAULT_IDLE_MS 100
+
+typedef enum
+{
+    FrameSET,
+    FrameUA,
+    FrameDISC,
+    FrameI,
+    FrameRR,
+    FrameREJ,
+    FrameSREJ,
+    FrameOther,
+    FRAME_TYPES
+} FrameType;
+
+const char *frameNames[FRAME_TYPES] = {"SET", "UA", "DISC", "I", "RR", "REJ", "SREJ", "?"};
+
+// Capture records, loaded in memory
+typedef struct
+{
+    CaptureRecord *record;
+    unsigned char *data;
+} Record;
+
+// What the cable did to the bytes of a chunk: the record that delivered or lost them
+typedef struct
+{
+    Record *delivered;
+    int lost;
+} ChunkFate;
+
+// One direction: the frame being rebuilt and the I-frames waiting for their acknowledgement
+typedef struct
+{
+    unsigned char frame[MAX_FRAME];
+    int size;
+    int inFrame;
+    int escaped;
+    int oversized;
+    double startMs;  // when its first byte was taken
+    int damaged;     // bytes of the frame the noise changed
+    int lost;        // bytes of the frame lost while the cable was off
+    int resized;     // part of it crossed in a chunk that lost or gained bytes
+
+    double sentMs[SEQ_SPACE]; // last transmission of each Ns
+    int transmissions[SEQ_SPACE];
+    int outstanding[SEQ_SPACE];
+    int base; // oldest Ns not acknowledged
+    int pending;
+    int nextNs; // Ns of the next new I-frame, -1 until the first
+
+    long frames[FRAME_TYPES];
+    long bytes;
+    long framesDamaged;
+    long framesLost;
+    long newFrames;
+    long retransmissions;
+    long spurious; // retransmissions of frames already acknowledged
+    double gapSum; // ms between a transmission and its retransmission
+    double gapMax;
+    long rttSamples;
+    double rttSum;
+    double rttMin;
+    double rttMax;
+} Side;
+
+typedef struct
+{
+    Side sides[2];
+    int quiet;
+    double startMs; // CLOCK_MONOTONIC of the start of the capture
+    double idleGapMs;
+    double lastActivity; // ms of the last bytes taken, -1 before any
+    double idleMs;
+    long idleGaps;
+} Decoder;
+
+const char *sideNames[2] = {"Tx > Rx", "Rx > Tx"};
+
+// Reads the whole capture. Returns the records, or NULL after printing what is wrong.
+Record *loadCapture(const char *path, int *count, double *startNs, unsigned char **file)
+{
+    FILE *in = fopen(path, "rb");
+    if (in == NULL)
+    {
+        perror(path);
+        return NULL;
+    }
+    fseek(in, 0, SEEK_END);
+    long size = ftell(in);
+    fseek(in, 0, SEEK_SET);
+    *file = malloc(size > 0 ? size : 1);
+    if (*file == NULL || fread(*file, 1, size, in) != (size_t)size)
+    {
+        perror("read");
+        fclose(in);
+        return NULL;
+    }
+    fclose(in);
+
+    CaptureHeader *header = (CaptureHeader *)*file;
+    if (size < (long)sizeof(CaptureHeader) || memcmp(header->magic, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)) != 0)
+    {
+        printf("%s: not a cable capture\n", path);
+        return NULL;
+    }
+    if (header->version != CAPTURE_VERSION)
+    {
+        printf("%s: capture version %u, expected %d\n", path, header->version, CAPTURE_VERSION);
+        return NULL;
+    }
+    *startNs = header->startNs;
+
+    int capacity = 1024;
+    Record *records = malloc(capacity * sizeof(Record));
+    long pos = sizeof(CaptureHeader);
+    *count = 0;
+    while (records != NULL && pos + (long)sizeof(CaptureRecord) <= size)
+    {
+        CaptureRecord *record = (CaptureRecord *)(*file + pos);
+        if (pos + (long)sizeof(CaptureRecord) + record->size > size)
+            break; // cut short, the cable did not finish writing it
+        if (*count == capacity)
+        {
+            capacity *= 2;
+            records = realloc(records, capacity * sizeof(Record));
+            if (records == NULL)
+                break;
+        }
+        records[*count].record = record;
+        records[*count].data = *file + pos + sizeof(CaptureRecord);
+        (*count)++;
+        pos += sizeof(CaptureRecord) + record->size;
+    }
+    if (records == NULL)
+        perror("malloc");
+    return records;
+}
+
+double recordMs(Record *record, double startNs)
+{
+    return (record->record->timeNs - startNs) / 1e6;
+}
+
+int hasSeq(unsigned char c)
+{
+    return c == C_IX || c == C_IXA || c == C_RRX || c == C_REJX || c == C_SREJX;
+}
+
+FrameType frameType(unsigned char c)
+{
+    switch (c)
+    {
+    case C_SET:
+        return FrameSET;
+    case C_UA:
+        return FrameUA;
+    case C_DISC:
+        return FrameDISC;
+    case 0x00:
+    case 0x40:
+    case C_IX:
+    case C_IXA:
+        return FrameI;
+    case 0x05:
+    case 0x85:
+    case C_RRX:
+        return FrameRR;
+    case 0x01:
+    case 0x81:
+    case C_REJX:
+        return FrameREJ;
+    case C_SREJX:
+        return FrameSREJ;
+    }
+    return FrameOther;
+}
+
+// Sequence numbers of the frame: Ns of I-frames, Nr of acknowledgements and of the
+// I-frames that carry one. -1 where the frame has none.
+void frameNumbers(const unsigned char *frame, int *ns, int *nr)
+{
+    unsigned char c = frame[1];
+    *ns = -1;
+    *nr = -1;
+    if (c == C_IX || c == C_IXA)
+        *ns = frame[2];
+    if (c == C_IXA)
+        *nr = frame[3];
+    else if (c == C_RRX || c == C_REJX || c == C_SREJX)
+        *nr = frame[2];
+    else if (c == 0x00 || c == 0x40)
+        *ns = c >> 6;
+    else if (frameType(c) == FrameRR || frameType(c) == FrameREJ)
+        *nr = c >> 7;
+}
+
+int headerSize(unsigned char c)
+{
+    return c == C_IXA ? 5 : hasSeq(c) ? 4 : 3;
+}
+
+// Forgets the I-frames in flight, when a new connection starts.
+void resetSequences(Decoder *decoder)
+{
+    for (int i = 0; i < 2; i++)
+    {
+        Side *side = &decoder->sides[i];
+        memset(side->sentMs, 0, sizeof(side->sentMs));
+        memset(side->transmissions, 0, sizeof(side->transmissions));
+        memset(side->outstanding, 0, sizeof(side->outstanding));
+        side->pending = 0;
+        side->nextNs = -1;
+    }
+}
+
+// The peer acknowledged every I-frame of "side" before "nr", and the acknowledgement
+// reached "side" at "now". Prints and counts their RTT, from the first byte of their last
+// transmission; frames sent more than once are ambiguous and not counted.
+void acknowledge(Decoder *decoder, Side *side, int nr, int seqMod, double now)
+{
+    while (side->pending > 0 && side->base != nr)
+    {
+        int ns = side->base;
+        if (side->outstanding[ns])
+        {
+            double rtt = now - side->sentMs[ns];
+            if (side->transmissions[ns] == 1)
+            {
+                if (side->rttSamples == 0 || rtt < side->rttMin)
+                    side->rttMin = rtt;
+                if (rtt > side->rttMax)
+                    side->rttMax = rtt;
+                side->rttSum += rtt;
+                side->rttSamples++;
+            }
+            if (!decoder->quiet)
+                printf(" [Ns=%d RTT %.1f ms%s]", ns, rtt, side->transmissions[ns] > 1 ? ", resent" : "");
+            side->outstanding[ns] = FALSE;
+            side->pending--;
+        }
+        side->base = (side->base + 1) % seqMod;
+    }
+}
+
+// Accounts for a frame "side" sent, completed at "now" ms and delivered at "arrivedMs".
+void decodeFrame(Decoder *decoder, int direction, double now, double arrivedMs)
+{
+    Side *side = &decoder->sides[direction];
+    Side *peer = &decoder->sides[!direction];
+    unsigned char *frame = side->frame;
+    if (side->size < 3 || side->size < headerSize(frame[1]))
+        return;
+
+    FrameType type = frameType(frame[1]);
+    int ns;
+    int nr;
+    frameNumbers(frame, &ns, &nr);
+    int seqMod = hasSeq(frame[1]) ? SEQ_SPACE : 2;
+    side->frames[type]++;
+    side->bytes += side->size;
+
+    if (!decoder->quiet)
+    {
+        printf("%10.3f  %s  %-4s", now / 1000, sideNames[direction], frameNames[type]);
+        if (ns >= 0)
+            printf(" Ns=%-3d", ns);
+        if (nr >= 0)
+            printf(" Nr=%-3d", nr);
+        printf(" %5d bytes, %.1f ms on the line", side->size, now - side->startMs);
+    }
+
+    if (type == FrameSET)
+        resetSequences(decoder);
+    if (type == FrameI && ns >= 0)
+    {
+        // new frames come in sequence, any other is sent again
+        if (side->nextNs < 0 || ns == side->nextNs || side->transmissions[ns] == 0)
+        {
+            side->newFrames++;
+            side->nextNs = (ns + 1) % seqMod;
+            side->transmissions[ns] = 0;
+            if (side->pending == 0)
+                side->base = ns;
+            side->outstanding[ns] = TRUE;
+            side->pending++;
+        }
+        else
+        {
+            double gap = side->startMs - side->sentMs[ns];
+            side->retransmissions++;
+            side->gapSum += gap;
+            if (gap > side->gapMax)
+                side->gapMax = gap;
+            if (!side->outstanding[ns])
+                side->spurious++;
+            if (!decoder->quiet)
+                printf(" [retransmission %d, %.1f ms after the last%s]", side->transmissions[ns], gap,
+                       side->outstanding[ns] ? "" : ", already acknowledged");
+        }
+        side->transmissions[ns]++;
+        side->sentMs[ns] = side->startMs;
+    }
+    // RR and REJ acknowledge the frames before Nr, SREJ only asks for Nr again.
+    // Only those that reach the peer intact do.
+    int intact = side->lost == 0 && side->damaged == 0 && !side->resized;
+    if (nr >= 0 && type != FrameSREJ && intact)
+        acknowledge(decoder, peer, nr, seqMod, arrivedMs);
+
+    if (side->lost > 0)
+        side->framesLost++;
+    else if (side->damaged > 0 || side->resized)
+        side->framesDamaged++;
+    if (!decoder->quiet)
+    {
+        if (side->lost > 0)
+            printf(" LOST (%d bytes while off)", side->lost);
+        else if (side->resized)
+            printf(" DAMAGED (bytes dropped or inserted)");
+        else if (side->damaged > 0)
+            printf(" DAMAGED (%d bytes changed)", side->damaged);
+        printf("\n");
+    }
+}
+
+// Feeds the bytes the cable took from a port to the frame parser of its direction.
+// "fate" tells what became of them, to mark the frames the noise damaged.
+void feedBytes(Decoder *decoder, int direction, Record *taken, ChunkFate *fate, double now)
+{
+    Side *side = &decoder->sides[direction];
+    int size = taken->record->size;
+    Record *delivered = fate->delivered;
+    int sameSize = delivered != NULL && delivered->record->size == taken->record->size;
+    double arrivedMs = delivered != NULL ? delivered->record->timeNs / 1e6 - decoder->startMs : now;
+
+    for (int i = 0; i < size; i++)
+    {
+        unsigned char byte = taken->data[i];
+        if (byte == FLAG)
+        {
+            if (side->inFrame && !side->oversized)
+                decodeFrame(decoder, direction, now, arrivedMs);
+            // a flag closes a frame and may open the next one
+            side->inFrame = TRUE;
+            side->size = 0;
+            side->escaped = FALSE;
+            side->oversized = FALSE;
+            side->startMs = now;
+            side->damaged = 0;
+            side->lost = 0;
+            side->resized = FALSE;
+            continue;
+        }
+        if (!side->inFrame)
+            continue;
+
+        if (fate->lost)
+            side->lost++;
+        else if (!sameSize)
+            side->resized = TRUE;
+        else if (delivered->data[i] != byte)
+            side->damaged++;
+
+        if (side->escaped)
+        {
+            byte ^= 0x20;
+            side->escaped = FALSE;
+        }
+        else if (byte == ESC)
+        {
+            side->escaped = TRUE;
+            continue;
+        }
+        if (side->size == MAX_FRAME)
+            side->oversized = TRUE;
+        else
+            side->frame[side->size++] = byte;
+    }
+}
+
+// Notes bytes on the line at "now", printing the idle gap that ends there.
+void lineActive(Decoder *decoder, double now)
+{
+    if (decoder->lastActivity >= 0)
+    {
+        double gap = now - decoder->lastActivity;
+        if (gap >= decoder->idleGapMs)
+        {
+            decoder->idleMs += gap;
+            decoder->idleGaps++;
+            if (!decoder->quiet)
+                printf("%10.3f  ------- idle for %.1f ms\n", decoder->lastActivity / 1000, gap);
+        }
+    }
+    decoder->lastActivity = now;
+}
+
+void printSide(Decoder *decoder, int direction)
+{
+    Side *side = &decoder->sides[direction];
+    long frames = 0;
+    for (int t = 0; t < FRAME_TYPES; t++)
+        frames += side->frames[t];
+
+    printf("%s: %ld frames, %ld bytes unstuffed (", sideNames[direction], frames, side->bytes);
+    const char *separator = "";
+    for (int t = 0; t < FRAME_TYPES; t++)
+    {
+        if (side->frames[t] > 0)
+        {
+            printf("%s%s %ld", separator, frameNames[t], side->frames[t]);
+            separator = ", ";
+        }
+    }
+    printf(")\n");
+    printf("  damaged by the noise: %ld, lost while off: %ld\n", side->framesDamaged, side->framesLost);
+    if (side->frames[FrameI] == 0)
+        return;
+    printf("  I-frames: %ld new, %ld retransmissions", side->newFrames, side->retransmissions);
+    if (side->retransmissions > 0)
+        printf(" (%ld already acknowledged), %.1f ms after the last on average, %.1f ms at most", side->spurious,
+               side->gapSum / side->retransmissions, side->gapMax);
+    printf("\n");
+    if (side->rttSamples > 0)
+        printf("  RTT of frames sent once: %ld samples, min %.1f ms, mean %.1f ms, max %.1f ms\n", side->rttSamples,
+               side->rttMin, side->rttSum / side->rttSamples, side->rttMax);
+}
+
+int main(int argc, char *argv[])
+{
+    Decoder *decoder = calloc(1, sizeof(Decoder));
+    if (decoder == NULL)
+    {
+        perror("calloc");
+        exit(1);
+    }
+    decoder->idleGapMs = DEFAULT_IDLE_MS;
+    decoder->lastActivity = -1;
+    resetSequences(decoder);
+
+    int option;
+    while ((option = getopt(argc, argv, "qg:")) != -1)
+    {
+        if (option == 'q')
+            decoder->quiet = TRUE;
+        else if (option == 'g')
+            decoder->idleGapMs = atof(optarg);
+        else
+            optind = argc + 1;
+    }
+    if (optind != argc - 1)
+    {
+        printf("Usage: %s [-q] [-g idle ms] capture\n", argv[0]);
+        exit(1);
+    }
+
+    int count;
+    double startNs;
+    unsigned char *file = NULL;
+    Record *records = loadCapture(argv[optind], &count, &startNs, &file);
+    if (records == NULL)
+        exit(1);
+    decoder->startMs = startNs / 1e6;
+
+    // what became of every chunk, found ahead of the bytes that were taken
+    uint32_t chunks = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (records[i].record->chunk > chunks)
+            chunks = records[i].record->chunk;
+    }
+    ChunkFate *fates = calloc(chunks + 1, sizeof(ChunkFate));
+    if (fates == NULL)
+    {
+        perror("calloc");
+        exit(1);
+    }
+    for (int i = 0; i < count; i++)
+    {
+        CaptureRecord *record = records[i].record;
+        if (record->kind == CaptureDelivered)
+            fates[record->chunk].delivered = &records[i];
+        else if (record->kind == CaptureLost)
+            fates[record->chunk].lost = TRUE;
+    }
+
+    double endMs = 0;
+    long commands = 0;
+    for (int i = 0; i < count; i++)
+    {
+        CaptureRecord *record = records[i].record;
+        double now = recordMs(&records[i], startNs);
+        endMs = now;
+        if (record->kind == CaptureCommand)
+        {
+            commands++;
+            if (!decoder->quiet)
+                printf("%10.3f  cable    %.*s\n", now / 1000, (int)record->size, (char *)records[i].data);
+        }
+        else if (record->kind == CaptureTaken && record->direction < 2)
+        {
+            lineActive(decoder, now);
+            feedBytes(decoder, record->direction, &records[i], &fates[record->chunk], now);
+        }
+    }
+
+    printf("\nCapture of %.3f s: %d records, %ld cable commands\n", endMs / 1000, count, commands);
+    for (int i = 0; i < 2; i++)
+        printSide(decoder, i);
+    printf("Idle: %.3f s in %ld gaps of %g ms or more", decoder->idleMs / 1000, decoder->idleGaps,
+           decoder->idleGapMs);
+    if (endMs > 0)
+        printf(" (%.0f%% of the capture)", 100 * decoder->idleMs / endMs);
+    printf("\n");
+
+    free(fates);
+    free(records);
+    free(file);
+    free(decoder);
+    return 0;
+}
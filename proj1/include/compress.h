@@ -0,0 +1,14 @@
+// Packet compression header.
+
+#ifndef _COMPRESS_H_
+#define _COMPRESS_H_
+
+// Compress n bytes of "in" into "out", writing at most "capacity" bytes.
+// Return the compressed size, or -1 if it does not fit in "capacity".
+int lzCompress(const unsigned char *in, int n, unsigned char *out, int capacity);
+
+// Decompress n bytes of "in" into "out", writing at most "capacity" bytes.
+// Return the decompressed size, or -1 if the input is malformed or does not fit.
+int lzDecompress(const unsigned char *in, int n, unsigned char *out, int capacity);
+
+#endif // _COMPRESS_H_
@@ -0,0 +1,23 @@
+// Forward error correction header.
+
+#ifndef _FEC_H_
+#define _FEC_H_
+
+// Largest number of parity bytes per Reed-Solomon block.
+#define MAX_FEC_PARITY 64
+
+// Parity bytes added to n bytes of data with "parity" bytes per block of up to 255 bytes.
+#define FEC_PARITY_SIZE(n, parity) ((parity) > 0 ? ((n) + 254 - (parity)) / (255 - (parity)) * (parity) : 0)
+
+// Compute the parity of n bytes of "data" followed by trailerSize bytes of "trailer" into
+// "out" (FEC_PARITY_SIZE(n + trailerSize, parity) bytes), "parity" bytes per block.
+// The blocks are interleaved byte by byte, so a burst of errors is spread over all of them.
+// Return the number of parity bytes written.
+int fecEncode(const unsigned char *data, int n, const unsigned char *trailer, int trailerSize, int parity, unsigned char *out);
+
+// Repair in place "size" bytes made of data followed by its parity.
+// Return the size of the data, or -1 if some block has more errors than it can correct.
+// "corrected" gets the number of bytes repaired.
+int fecDecode(unsigned char *data, int size, int parity, int *corrected);
+
+#endif // _FEC_H_
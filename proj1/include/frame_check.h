@@ -0,0 +1,26 @@
+// Frame check header.
+
+#ifndef _FRAME_CHECK_H_
+#define _FRAME_CHECK_H_
+
+#include "link_layer.h"
+
+// Largest check appended to a frame.
+#define MAX_FRAME_CHECK_SIZE 4
+
+// Size in bytes of the check appended to the frame data.
+int frameCheckSize(FrameCheck check);
+
+// Compute the check of n bytes of data into "out" (frameCheckSize bytes, most significant first).
+void frameCheckCompute(FrameCheck check, const unsigned char *data, int n, unsigned char *out);
+
+// XOR of n bytes (the legacy BCC2).
+unsigned char xorFold(const unsigned char *data, int n);
+
+// CRC-16-CCITT (polynomial 0x1021, initial value 0xFFFF).
+unsigned short crc16Ccitt(const unsigned char *data, int n);
+
+// CRC-32C (Castagnoli, reflected polynomial 0x82F63B78).
+unsigned int crc32c(const unsigned char *data, int n);
+
+#endif // _FRAME_CHECK_H_
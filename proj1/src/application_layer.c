@@ -2,6 +2,7 @@
 
 #include "application_layer.h"
 #include "link_layer.h"
+#include "compress.h"
 #include <string.h>
 #include <fcntl.h>
 #include <stdio.h>
@@ -12,25 +13,58 @@
 #include <termios.h>
 #include <unistd.h>
 #include <math.h>
+#include <pthread.h>
+#include <sys/mman.h>
 #include <sys/time.h>
 
+// Control field of the application packets
+#define PACKET_DATA 1
+#define PACKET_START 2
+#define PACKET_END 3
+#define PACKET_DATA_LZ 4 // data packet compressed with lzCompress
+#define PACKET_RESUME 5 // the receiver's answer to a start packet, with TLV_RESUME_OFFSET
 
+// Parameters of the start / end packets, as (type, length, value)
+#define TLV_FILE_SIZE 0
+#define TLV_FILE_NAME 1
+#define TLV_COMPRESSION 2 // 1 if data packets may be compressed
+#define TLV_RESUME 3 // 1 if the transmitter waits for a PACKET_RESUME
+#define TLV_RESUME_OFFSET 4 // bytes at the start of the file the receiver already has
 
-unsigned char* parseControlPacket(unsigned char* packet, int size, int* nameSize) {
-    unsigned char fileSizeNBytes = packet[6];
-    unsigned char fileSizeAux[fileSizeNBytes];
-    memcpy(fileSizeAux, packet + 7, fileSizeNBytes);
-    unsigned char fileNameNBytes = packet[7 + fileSizeNBytes + 1];
-    unsigned char* name = (unsigned char* )malloc(fileNameNBytes);
-    memcpy(name, packet + 7 + fileSizeNBytes + 2, fileNameNBytes);
-    *nameSize = fileNameNBytes;
-    return name;
+
+typedef struct {
+    long int fileSize;
+    char name[256];
+    int compression;
+    int resume;            // the transmitter waits for a PACKET_RESUME
+    long int resumeOffset;
+} ControlPacket;
+
+void parseControlPacket(unsigned char* packet, int size, ControlPacket* control) {
+    int pos = 1;
+    memset(control, 0, sizeof(ControlPacket));
+    while (pos + 2 <= size && pos + 2 + packet[pos + 1] <= size) {
+        unsigned char type = packet[pos];
+        unsigned char length = packet[pos + 1];
+        const unsigned char* value = packet + pos + 2;
+        if (type == TLV_FILE_SIZE) {
+            for (int i = 0; i < length; i++) control->fileSize = control->fileSize << 8 | value[i];
+        }
+        else if (type == TLV_FILE_NAME && control->name[0] == '\0') memcpy(control->name, value, length);
+        else if (type == TLV_COMPRESSION && length == 1) control->compression = value[0];
+        else if (type == TLV_RESUME && length == 1) control->resume = value[0];
+        else if (type == TLV_RESUME_OFFSET) {
+            for (int i = 0; i < length; i++) control->resumeOffset = control->resumeOffset << 8 | value[i];
+        }
+        pos += 2 + length;
+    }
 }
 
-unsigned char* getControlPacket(const unsigned int c, const char* filename, long int length, unsigned int* size) {
-    const int L1 = (int)ceil(log2f((float)length) / 8.0);
+unsigned char* getControlPacket(const unsigned int c, const char* filename, long int length, int compress, int resume, unsigned int* size) {
+    int L1 = 1; // bytes needed for the length
+    while (L1 < (int)sizeof(length) && length >> (8 * L1) != 0) L1++;
     const int L2 = strlen(filename);
-    *size = 1 + 2 + L1 + 2 + L2;
+    *size = 1 + 2 + L1 + 2 + L2 + 3 + (resume ? 3 : 0);
     unsigned char* packet = (unsigned char* )malloc(*size);
 
     unsigned int pos = 0;
@@ -46,171 +80,786 @@ unsigned char* getControlPacket(const unsigned int c, const char* filename, long
     packet[pos++] = 1;
     packet[pos++] = L2;
     memcpy(packet + pos, filename, L2);
+    pos += L2;
+    packet[pos++] = TLV_COMPRESSION;
+    packet[pos++] = 1;
+    packet[pos++] = compress;
+    if (resume) {
+        packet[pos++] = TLV_RESUME;
+        packet[pos++] = 1;
+        packet[pos++] = TRUE;
+    }
+    return packet;
+}
+
+// Builds the answer to a start packet: the transmitter goes on from byte "offset".
+unsigned char* getResumePacket(long int offset, unsigned int* size) {
+    int L = 1;
+    while (L < (int)sizeof(offset) && offset >> (8 * L) != 0) L++;
+    *size = 1 + 2 + L;
+    unsigned char* packet = (unsigned char* )malloc(*size);
+    packet[0] = PACKET_RESUME;
+    packet[1] = TLV_RESUME_OFFSET;
+    packet[2] = L;
+    for (int i = L - 1; i >= 0; i--) {
+        packet[3 + i] = offset & 0xFF;
+        offset >>= 8;
+    }
     return packet;
 }
 
-unsigned char* getDataPacket(unsigned char sequence, unsigned char* data, int dataSize, int* packetSize) {
-    *packetSize = 1 + 1 + 2 + dataSize;
-    unsigned char* packet = (unsigned char* )malloc(*packetSize);
+// Builds the data packet into "packet", which holds 4 + dataSize bytes. Returns its size.
+// The data is compressed when "compress" is set and it shrinks, otherwise it goes as is.
+int getDataPacket(unsigned char sequence, const unsigned char* data, int dataSize, int compress, unsigned char* packet) {
+    int size = compress ? lzCompress(data, dataSize, packet + 4, dataSize - 1) : -1;
 
-    packet[0] = 1;
+    packet[0] = size > 0 ? PACKET_DATA_LZ : PACKET_DATA;
+    if (size <= 0) {
+        size = dataSize;
+        memcpy(packet + 4, data, dataSize);
+    }
     packet[1] = sequence;
-    packet[2] = dataSize >> 8 & 0xFF;
-    packet[3] = dataSize & 0xFF;
-    memcpy(packet + 4, data, dataSize);
+    packet[2] = size >> 8 & 0xFF;
+    packet[3] = size & 0xFF;
 
-    return packet;
+    return 1 + 1 + 2 + size;
+}
+
+// Bonded transfers: the serial port argument may list several ports separated by commas
+// ("/dev/ttyS10,/dev/ttyS12"). Data packets are striped across all of them and the
+// receiver puts them back in order using their sequence number.
+#define MAX_LINKS 8
+#define SEQUENCE_MOD 255
+// Packets the receiver buffers ahead of the next one to write. Together with the packets
+// held in the link windows it must stay below SEQUENCE_MOD, so sequence numbers are unambiguous.
+#define REORDER_WINDOW 128
+
+typedef enum {
+    StripeRoundRobin,   // packet i goes to link i % nLinks
+    StripeByThroughput, // each link takes the next packet as soon as it is free
+} StripePolicy;
+
+#define STRIPE_POLICY StripeByThroughput
+
+// Bytes of the file asked for ahead of the packets being sent
+#define READ_AHEAD (256 * 1024)
+
+// Adaptive packet size: each link starts with MAX_PAYLOAD_SIZE bytes of data per packet.
+// Every CHUNK_PERIOD frames the size doubles if none of them met a REJ or a timeout, up to
+// what llopen negotiated, and halves if more than CHUNK_SHRINK_RATE of them did.
+#define MIN_CHUNK_SIZE 128
+#define CHUNK_PERIOD 32
+#define CHUNK_SHRINK_RATE 0.1
+
+// Reed-Solomon parity bytes per 255 byte block of frame data, proposed in llopen.
+// Noisy or long lines repair most errors without a retransmission; 0 turns it off.
+#define FEC_PARITY 0
+
+// Print the counters of every link when it is closed
+#define SHOW_STATISTICS TRUE
+
+// Resumable transfers: the receiver saves the byte ranges it wrote in "<output>.checkpoint"
+// every CHECKPOINT_INTERVAL bytes. When a transfer of the same file is started again the
+// transmitter learns from the answer to its start packet where to go on from.
+#define CHECKPOINT_INTERVAL (64 * 1024)
+#define CHECKPOINT_SUFFIX ".checkpoint"
+// Ranges kept in the checkpoint. Packets are written nearly in order, so a few are enough.
+#define MAX_RANGES 32
+
+typedef struct {
+    LinkConnection* links[MAX_LINKS];
+    int nLinks;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+
+    // transmitter: the file is mapped, read ahead of the packets being built and
+    // dropped behind them, so memory stays bounded whatever the size of the file
+    int fileFd;
+    const unsigned char* content;
+    long int fileSize;
+    long int readAhead;            // the file up to here was asked for in advance
+    long int released;             // the pages before this were dropped
+    long int building[MAX_LINKS];  // offset of the packet each link is building, -1 if none
+    long int nextPacket;
+    long int nextOffset; // packets have different sizes, each takes the data from here
+    int sendFailed;
+    int resumable;       // the peer negotiated in llopen, so it answers the start packet
+    int compress;        // the peers of every link negotiated in llopen, so they read PACKET_DATA_LZ
+
+    // receiver: the file is preallocated and every packet is written at its offset, the sum
+    // of the sizes of the packets before it. The packet that comes next goes straight from
+    // the link buffer, the ones that arrive early wait in a slot until it is their turn.
+    int outputFd;
+    int maxPacketSize;               // largest packet any link may deliver
+    unsigned char* slots;            // REORDER_WINDOW packets of data, maxPacketSize bytes each
+    int slotSize[REORDER_WINDOW];    // bytes of data, -1 if the slot is free
+    long int slotIndex[REORDER_WINDOW];
+    long int nextIndex;              // next packet in sequence order
+    long int writeOffset;            // where it goes in the file
+    long int written;                // bytes written so far
+    long int expectedSize;           // announced in the start packet
+    int linksDone;
+    int linksFailed;                 // links whose receive loop ended on an error
+    int writing;                     // packets being written with the lock released
+    int receiveDone;                 // the whole file was written
+    int receiveFailed;               // a packet could not be used, the transfer is aborted
+
+    // receiver: byte ranges of the output already written, sorted and disjoint
+    char fileName[256];              // announced in the start packet
+    char checkpointPath[300];
+    long int ranges[MAX_RANGES][2];
+    int nRanges;
+    long int checkpointed;           // bytes written when the checkpoint was last saved
+    int checkpointing;
+} Bond;
+
+typedef struct {
+    Bond* bond;
+    int link;
+    long int packets;
+    double elapsed; // time spent in llwrite
+    int failed;
+    long int dataBytes;   // bytes of data packets sent, after compression
+    int chunkSize;        // data bytes of the next packet
+    LinkStatistics last;  // counters when chunkSize was last revised
+} LinkWorker;
+
+int openLinks(Bond* bond, LinkLayer linkLayer, const char* serialPorts) {
+    char ports[MAX_LINKS * 50];
+    strncpy(ports, serialPorts, sizeof(ports) - 1);
+    ports[sizeof(ports) - 1] = '\0';
+
+    char* save;
+    for (char* port = strtok_r(ports, ",", &save); port != NULL; port = strtok_r(NULL, ",", &save)) {
+        if (bond->nLinks == MAX_LINKS) {
+            printf("Only %d serial ports can be bonded\n", MAX_LINKS);
+            return -1;
+        }
+        strncpy(linkLayer.serialPort, port, sizeof(linkLayer.serialPort) - 1);
+        linkLayer.serialPort[sizeof(linkLayer.serialPort) - 1] = '\0';
+        if ((bond->links[bond->nLinks] = llopenConnection(linkLayer)) == NULL) {
+            printf("Connection error on %s\n", port);
+            return -1;
+        }
+        bond->nLinks++;
+    }
+    if (bond->nLinks == 0) return -1;
+
+    LinkStatistics statistics;
+    bond->compress = TRUE;
+    for (int i = 0; i < bond->nLinks; i++) {
+        llstatisticsConnection(bond->links[i], &statistics);
+        if (statistics.maxFramePayload > bond->maxPacketSize) bond->maxPacketSize = statistics.maxFramePayload;
+        if (i == 0) bond->resumable = statistics.extendedFrames;
+        // a receiver from before the compression writes PACKET_DATA_LZ into the file as it is
+        bond->compress &= statistics.extendedFrames;
+    }
+    return bond->nLinks;
+}
+
+// Revises the packet size of the link from the REJs and timeouts of its last frames.
+void adaptChunkSize(LinkWorker* worker) {
+    LinkStatistics now;
+    LinkStatistics* last = &worker->last;
+    llstatisticsConnection(worker->bond->links[worker->link], &now);
+
+    long int frames = now.framesSent - last->framesSent;
+    if (frames < CHUNK_PERIOD) return;
+    long int errors = (now.rejReceived - last->rejReceived) + (now.timeouts - last->timeouts);
+    int maxChunk = now.maxFramePayload - 4;
+    int chunk = worker->chunkSize;
+
+    // the timeouts of the first frames come from the retransmission timeout settling down
+    if (worker->packets > CHUNK_PERIOD) {
+        if (errors == 0) chunk = chunk * 2 < maxChunk ? chunk * 2 : maxChunk;
+        else if (errors > CHUNK_SHRINK_RATE * frames) chunk = chunk / 2 > MIN_CHUNK_SIZE ? chunk / 2 : MIN_CHUNK_SIZE;
+    }
+    if (chunk != worker->chunkSize) {
+        printf("Link %d: %d byte packets (%ld errors in %ld frames)\n", worker->link, chunk, errors, frames);
+        worker->chunkSize = chunk;
+    }
+    *last = now;
+}
+
+// Asks for the file ahead of the next packet and drops the pages no link is using any more.
+// Called with the bond locked.
+void advanceSource(Bond* bond) {
+    long int page = sysconf(_SC_PAGESIZE);
+    long int low = bond->nextOffset;
+    for (int i = 0; i < bond->nLinks; i++) {
+        if (bond->building[i] >= 0 && bond->building[i] < low) low = bond->building[i];
+    }
+    low -= low % page;
+    if (low > bond->released) {
+        madvise((unsigned char* )bond->content + bond->released, low - bond->released, MADV_DONTNEED);
+        bond->released = low;
+    }
+    if (bond->readAhead < bond->fileSize && bond->nextOffset + READ_AHEAD / 2 > bond->readAhead) {
+        posix_fadvise(bond->fileFd, bond->readAhead, READ_AHEAD, POSIX_FADV_WILLNEED);
+        bond->readAhead += READ_AHEAD;
+    }
 }
 
-unsigned char* getData(FILE *fd, long int fileLength) {
-    unsigned char* content = (unsigned char* )malloc(sizeof(unsigned char) * fileLength);
-    fread(content, sizeof(unsigned char), fileLength, fd);
-    return content;
+// Takes the next piece of the file for the worker's link, once the previous one was built.
+// Returns FALSE once the whole file was taken or another link failed.
+int nextChunk(LinkWorker* worker, long int* index, long int* offset, int* size) {
+    Bond* bond = worker->bond;
+    pthread_mutex_lock(&bond->lock);
+    bond->building[worker->link] = -1;
+    // round robin: packet i goes to link i % nLinks, so the links take turns
+    while (STRIPE_POLICY == StripeRoundRobin && !bond->sendFailed && bond->nextOffset < bond->fileSize &&
+           bond->nextPacket % bond->nLinks != worker->link) {
+        pthread_cond_wait(&bond->changed, &bond->lock);
+    }
+    int more = !bond->sendFailed && bond->nextOffset < bond->fileSize;
+    if (more) {
+        *index = bond->nextPacket++;
+        *offset = bond->nextOffset;
+        *size = bond->fileSize - *offset > worker->chunkSize ? worker->chunkSize : bond->fileSize - *offset;
+        bond->nextOffset += *size;
+        bond->building[worker->link] = *offset;
+        pthread_cond_broadcast(&bond->changed);
+    }
+    advanceSource(bond);
+    pthread_mutex_unlock(&bond->lock);
+    return more;
 }
 
-void parseDataPacket(const unsigned char* packet, const unsigned int packetSize, unsigned char* buffer) {
-    memcpy(buffer, packet + 4, packetSize - 4);
-    buffer += packetSize;
+void* sendPackets(void* arg) {
+    LinkWorker* worker = (LinkWorker* )arg;
+    Bond* bond = worker->bond;
+    long int index, offset;
+    int dataSize;
+    struct timeval start_packet_time, end_packet_time;
+
+    llstatisticsConnection(bond->links[worker->link], &worker->last);
+    worker->chunkSize = worker->last.maxFramePayload - 4 < MAX_PAYLOAD_SIZE ? worker->last.maxFramePayload - 4 : MAX_PAYLOAD_SIZE;
+    unsigned char* packet = (unsigned char* )malloc(worker->last.maxFramePayload);
+
+    while (nextChunk(worker, &index, &offset, &dataSize)) {
+        int packetSize = getDataPacket(index % SEQUENCE_MOD, bond->content + offset, dataSize, bond->compress, packet);
+
+        gettimeofday(&start_packet_time, NULL);
+        int result = llwriteConnection(bond->links[worker->link], packet, packetSize); // send data packet
+        gettimeofday(&end_packet_time, NULL);
+        if (result == -1) {
+            worker->failed = TRUE;
+            pthread_mutex_lock(&bond->lock);
+            bond->sendFailed = TRUE;
+            pthread_cond_broadcast(&bond->changed);
+            pthread_mutex_unlock(&bond->lock);
+            break;
+        }
+
+        worker->elapsed += (end_packet_time.tv_sec - start_packet_time.tv_sec) +
+                   (end_packet_time.tv_usec - start_packet_time.tv_usec) / 1e6;
+        worker->packets++;
+        worker->dataBytes += packetSize - 4;
+        adaptChunkSize(worker);
+    }
+    free(packet);
+    return NULL;
 }
 
-    struct timeval start_total_time, end_total_time, start_packet_time, end_packet_time;
+// Writes "size" bytes at "offset" of the output, without going past the announced size.
+void writeOutput(Bond* bond, const unsigned char* data, int size, long int offset) {
+    if (offset + size > bond->expectedSize) size = bond->expectedSize > offset ? bond->expectedSize - offset : 0;
+    while (size > 0) {
+        ssize_t bytes = pwrite(bond->outputFd, data, size, offset);
+        if (bytes <= 0) {
+            perror("pwrite");
+            return;
+        }
+        data += bytes;
+        size -= bytes;
+        offset += bytes;
+    }
+}
+
+// Adds [start, end) to the ranges written, merging the ones it touches.
+// When they are all taken the range is left out: the checkpoint may miss bytes, never claim them.
+void addRange(Bond* bond, long int start, long int end) {
+    if (start >= end) return;
+    int first = 0;
+    while (first < bond->nRanges && bond->ranges[first][1] < start) first++;
+    int last = first;
+    for (; last < bond->nRanges && bond->ranges[last][0] <= end; last++) {
+        if (bond->ranges[last][0] < start) start = bond->ranges[last][0];
+        if (bond->ranges[last][1] > end) end = bond->ranges[last][1];
+    }
+    if (first == last && bond->nRanges == MAX_RANGES) return;
+    memmove(bond->ranges[first + 1], bond->ranges[last], (bond->nRanges - last) * sizeof(bond->ranges[0]));
+    bond->nRanges += 1 - (last - first);
+    bond->ranges[first][0] = start;
+    bond->ranges[first][1] = end;
+}
 
-    double elapsed_total_time, elapsed_prop_time;
+// Saves the ranges in the checkpoint. The data they describe is flushed first and the new
+// checkpoint replaces the old one in a single rename, so a crash leaves one or the other.
+void saveCheckpoint(Bond* bond, long int ranges[][2], int nRanges) {
+    char path[sizeof(bond->checkpointPath) + 4];
+    snprintf(path, sizeof(path), "%s.tmp", bond->checkpointPath);
+    fdatasync(bond->outputFd);
 
-    double elapsed_packet_time[50];
+    FILE* file = fopen(path, "w");
+    if (file == NULL) {
+        perror("Checkpoint");
+        return;
+    }
+    fprintf(file, "%ld %s\n", bond->expectedSize, bond->fileName);
+    for (int i = 0; i < nRanges; i++) fprintf(file, "%ld %ld\n", ranges[i][0], ranges[i][1]);
+    if (fflush(file) != 0 || fsync(fileno(file)) < 0) perror("Checkpoint");
+    fclose(file);
+    rename(path, bond->checkpointPath);
+}
+
+// Saves the checkpoint once CHECKPOINT_INTERVAL more bytes were written, called with the bond locked.
+// The disk is waited for with the lock released, so the other links keep delivering.
+void updateCheckpoint(Bond* bond) {
+    if (bond->checkpointing || bond->receiveDone || bond->written - bond->checkpointed < CHECKPOINT_INTERVAL) return;
+    long int ranges[MAX_RANGES][2];
+    int nRanges = bond->nRanges;
+    long int written = bond->written;
+    memcpy(ranges, bond->ranges, sizeof(ranges));
+    bond->checkpointing = TRUE;
+    pthread_mutex_unlock(&bond->lock);
+
+    saveCheckpoint(bond, ranges, nRanges);
+
+    pthread_mutex_lock(&bond->lock);
+    bond->checkpointing = FALSE;
+    bond->checkpointed = written;
+    pthread_cond_broadcast(&bond->changed);
+}
 
+// Reads the checkpoint left by a transfer of the same file that was cut short.
+// Returns the number of bytes at the start of the output that already arrived.
+long int loadCheckpoint(Bond* bond) {
+    FILE* file = fopen(bond->checkpointPath, "r");
+    if (file == NULL) return 0;
+
+    char line[sizeof(bond->fileName) + 32];
+    long int size = -1;
+    char name[sizeof(bond->fileName)] = "";
+    if (fgets(line, sizeof(line), file) != NULL) {
+        int at = 0;
+        if (sscanf(line, "%ld %n", &size, &at) == 1) {
+            strncpy(name, line + at, sizeof(name) - 1);
+            name[strcspn(name, "\n")] = '\0';
+        }
+    }
+    long int start, end;
+    bond->nRanges = 0;
+    if (size == bond->expectedSize && !strcmp(name, bond->fileName)) {
+        while (fscanf(file, "%ld %ld", &start, &end) == 2) {
+            if (start >= 0 && end <= size) addRange(bond, start, end);
+        }
+    }
+    fclose(file);
+    return bond->nRanges > 0 && bond->ranges[0][0] == 0 ? bond->ranges[0][1] : 0;
+}
+
+// Once a link failed the packets it held never arrive, so nothing waits for its turn any more.
+int receiveStopped(Bond* bond) {
+    return bond->receiveFailed || bond->linksFailed > 0;
+}
+
+// Puts the data of packet "index" in the file, called with the bond locked.
+// The next packet is written right away together with the ones waiting after it,
+// the others are kept until their turn comes.
+void deliverPacket(Bond* bond, long int index, const unsigned char* data, int size) {
+    int slot = index % REORDER_WINDOW;
+    // the slot may still hold the packet REORDER_WINDOW before, until it is written
+    while (index != bond->nextIndex && bond->slotSize[slot] >= 0) {
+        if (bond->receiveDone || receiveStopped(bond)) return;
+        pthread_cond_wait(&bond->changed, &bond->lock);
+    }
+    if (index != bond->nextIndex) {
+        memcpy(bond->slots + slot * bond->maxPacketSize, data, size);
+        bond->slotSize[slot] = size;
+        bond->slotIndex[slot] = index;
+        return;
+    }
+
+    // take this packet and the run after it, then write them with the lock released
+    long int offset = bond->writeOffset;
+    long int last = index;
+    bond->writeOffset += size;
+    bond->nextIndex++;
+    for (slot = bond->nextIndex % REORDER_WINDOW; bond->slotSize[slot] >= 0 && bond->slotIndex[slot] == bond->nextIndex;
+         slot = bond->nextIndex % REORDER_WINDOW) {
+        bond->writeOffset += bond->slotSize[slot];
+        last = bond->nextIndex++;
+    }
+    bond->writing++;
+    pthread_cond_broadcast(&bond->changed);
+    pthread_mutex_unlock(&bond->lock);
+
+    long int bytes = size;
+    writeOutput(bond, data, size, offset);
+    offset += size;
+    for (long int i = index + 1; i <= last; i++) {
+        slot = i % REORDER_WINDOW;
+        writeOutput(bond, bond->slots + slot * bond->maxPacketSize, bond->slotSize[slot], offset);
+        offset += bond->slotSize[slot];
+        bytes += bond->slotSize[slot];
+    }
+
+    pthread_mutex_lock(&bond->lock);
+    bond->writing--;
+    for (long int i = index + 1; i <= last; i++) bond->slotSize[i % REORDER_WINDOW] = -1;
+    bond->written += bytes;
+    addRange(bond, offset - bytes, offset < bond->expectedSize ? offset : bond->expectedSize);
+    pthread_cond_broadcast(&bond->changed);
+    updateCheckpoint(bond);
+}
+
+void* receivePackets(void* arg) {
+    LinkWorker* worker = (LinkWorker* )arg;
+    Bond* bond = worker->bond;
+    unsigned char* packet = (unsigned char* )malloc(bond->maxPacketSize);
+    // a packet never expands to more than the largest frame
+    unsigned char* expanded = (unsigned char* )malloc(bond->maxPacketSize);
+    int packetSize;
+
+    while ((packetSize = llreadConnection(bond->links[worker->link], packet)) > 0) {
+        if (packet[0] != PACKET_DATA && packet[0] != PACKET_DATA_LZ) continue; // end packet, the link is closed next
+
+        unsigned char* data = packet + 4;
+        int dataSize = packetSize - 4;
+        if (packet[0] == PACKET_DATA_LZ) {
+            dataSize = lzDecompress(data, dataSize, expanded, bond->maxPacketSize);
+            data = expanded;
+            // every packet after it would be written at the wrong offset
+            if (dataSize < 0) {
+                printf("Packet %d cannot be decompressed\n", packet[1]);
+                worker->failed = TRUE;
+                pthread_mutex_lock(&bond->lock);
+                bond->receiveFailed = TRUE;
+                pthread_cond_broadcast(&bond->changed);
+                pthread_mutex_unlock(&bond->lock);
+                break;
+            }
+        }
+
+        pthread_mutex_lock(&bond->lock);
+        if (bond->receiveDone) { // nothing is written past the announced size
+            pthread_mutex_unlock(&bond->lock);
+            continue;
+        }
+        // every packet still on its way is less than SEQUENCE_MOD packets ahead of nextIndex
+        long int index = bond->nextIndex +
+                         (packet[1] - bond->nextIndex % SEQUENCE_MOD + SEQUENCE_MOD) % SEQUENCE_MOD;
+        while (index >= bond->nextIndex + REORDER_WINDOW && !bond->receiveDone && !receiveStopped(bond)) {
+            pthread_cond_wait(&bond->changed, &bond->lock);
+        }
+        if (receiveStopped(bond)) { // the file cannot be completed, this link gives up too
+            pthread_mutex_unlock(&bond->lock);
+            break;
+        }
+        if (!bond->receiveDone) {
+            deliverPacket(bond, index, data, dataSize);
+            worker->packets++;
+        }
+        pthread_mutex_unlock(&bond->lock);
+    }
+    if (packetSize < 0) worker->failed = TRUE;
+    free(packet);
+    free(expanded);
+
+    pthread_mutex_lock(&bond->lock);
+    bond->linksDone++;
+    if (packetSize < 0) bond->linksFailed++;
+    pthread_cond_broadcast(&bond->changed);
+    pthread_mutex_unlock(&bond->lock);
+    return NULL;
+}
+
+// Creates the output with the size announced in the start packet. If "resume" is set and a
+// checkpoint of the same file is next to it, the bytes it lists are kept.
+// Returns the number of bytes at the start of the file that do not have to be sent again.
+long int openOutput(Bond* bond, const char* filename, int resume) {
+    snprintf(bond->checkpointPath, sizeof(bond->checkpointPath), "%s%s", filename, CHECKPOINT_SUFFIX);
+    long int resumeOffset = resume ? loadCheckpoint(bond) : 0;
+    struct stat st;
+    if (resumeOffset > 0 && (stat(filename, &st) < 0 || st.st_size < resumeOffset)) resumeOffset = 0;
+    if (resumeOffset == 0) bond->nRanges = 0;
+
+    if ((bond->outputFd = open(filename, O_WRONLY | O_CREAT | (resumeOffset > 0 ? 0 : O_TRUNC), 0644)) < 0) {
+        perror("File not found\n");
+        exit(-1);
+    }
+    int error = bond->expectedSize > 0 ? posix_fallocate(bond->outputFd, 0, bond->expectedSize) : 0;
+    if (error != 0) printf("Cannot preallocate %ld bytes: %s\n", bond->expectedSize, strerror(error));
+    if (resumeOffset > 0) printf("Resuming at byte %ld of %ld\n", resumeOffset, bond->expectedSize);
+
+    bond->writeOffset = bond->written = bond->checkpointed = resumeOffset;
+    bond->slots = (unsigned char* )malloc(REORDER_WINDOW * bond->maxPacketSize);
+    for (int i = 0; i < REORDER_WINDOW; i++) bond->slotSize[i] = -1;
+    return resumeOffset;
+}
+
+// Waits until the announced size was written, every link is closed, a link failed or a packet did.
+// A complete file drops its checkpoint; one cut short keeps its size and the checkpoint
+// records which bytes arrived, for the next transfer to go on from.
+// Returns the number of bytes written.
+long int closeOutput(Bond* bond) {
+    pthread_mutex_lock(&bond->lock);
+    while ((bond->written < bond->expectedSize && bond->linksDone < bond->nLinks && !receiveStopped(bond)) ||
+           bond->checkpointing || bond->writing > 0) {
+        pthread_cond_wait(&bond->changed, &bond->lock);
+    }
+    bond->receiveDone = TRUE;
+    long int written = bond->written;
+    pthread_cond_broadcast(&bond->changed);
+    pthread_mutex_unlock(&bond->lock);
+
+    if (written < bond->expectedSize) {
+        saveCheckpoint(bond, bond->ranges, bond->nRanges);
+        printf("Transfer cut short at %ld of %ld bytes, checkpoint saved\n", written, bond->expectedSize);
+    }
+    else unlink(bond->checkpointPath);
+    close(bond->outputFd);
+    return written;
+}
+
+// Maps the file to send. Nothing is read until the packets need it.
+void openSource(Bond* bond, const char* filename) {
+    struct stat st;
+    if ((bond->fileFd = open(filename, O_RDONLY)) < 0 || fstat(bond->fileFd, &st) < 0) {
+        perror("File not found\n");
+        exit(-1);
+    }
+
+    long int fileSize = st.st_size;
+    printf("File size: %ld\n", fileSize);
+    bond->fileSize = fileSize;
+    for (int i = 0; i < MAX_LINKS; i++) bond->building[i] = -1;
+    if (fileSize == 0) return;
+
+    void* content = mmap(NULL, fileSize, PROT_READ, MAP_PRIVATE, bond->fileFd, 0);
+    if (content == MAP_FAILED) {
+        perror("mmap");
+        exit(-1);
+    }
+    madvise(content, fileSize, MADV_SEQUENTIAL);
+    bond->content = content;
+}
+
+void closeSource(Bond* bond) {
+    if (bond->content != NULL) munmap((void* )bond->content, bond->fileSize);
+    close(bond->fileFd);
+}
+
+// Sends the start packet. A receiver that negotiated in llopen answers with the bytes it
+// already has from an earlier transfer of the file, and the packets start after them.
+void sendStartPacket(Bond* bond, const char* filename) {
+    unsigned int cpSize;
+    unsigned char* controlPacketStart = getControlPacket(PACKET_START, filename, bond->fileSize, bond->compress, bond->resumable, &cpSize);
+    if (llwriteConnection(bond->links[0], controlPacketStart, cpSize) == -1) { // send start packet
+        printf("Exit: error in start packet\n");
+        exit(-1);
+    }
+    free(controlPacketStart);
+    printf("Start packet sent\n");
+    if (!bond->resumable) return;
+
+    unsigned char* packet = (unsigned char* )malloc(bond->maxPacketSize);
+    int packetSize;
+    // 0 once the peer sent DISC: it closed the link without answering
+    while ((packetSize = llreadConnection(bond->links[0], packet)) > 0 && packet[0] != PACKET_RESUME);
+    if (packetSize <= 0) {
+        printf("Exit: no answer to the start packet\n");
+        exit(-1);
+    }
+    ControlPacket answer;
+    parseControlPacket(packet, packetSize, &answer);
+    free(packet);
+
+    long int offset = answer.resumeOffset < bond->fileSize ? answer.resumeOffset : bond->fileSize;
+    if (offset > 0) {
+        printf("Resuming at byte %ld of %ld\n", offset, bond->fileSize);
+        bond->nextOffset = bond->readAhead = offset;
+        bond->released = offset - offset % sysconf(_SC_PAGESIZE);
+    }
+}
+
+// Reads the start packet, creates "filename" for the file announced and, if the transmitter
+// asks for it, answers with the bytes already there.
+void readStartPacket(Bond* bond, const char* filename) {
+    unsigned char* packet = (unsigned char* )malloc(bond->maxPacketSize);
+    int packetSize = llreadConnection(bond->links[0], packet); // wait for start packet
+    if (packetSize <= 0) {
+        printf("Exit: no start packet\n");
+        exit(-1);
+    }
+    printf("Start packet received\n");
+    ControlPacket start;
+    parseControlPacket(packet, packetSize, &start);
+    if (start.compression) printf("Data packets may be compressed\n");
+    free(packet);
+
+    bond->expectedSize = start.fileSize;
+    strcpy(bond->fileName, start.name);
+    long int offset = openOutput(bond, filename, start.resume);
+    if (!start.resume) return;
+
+    unsigned int answerSize;
+    unsigned char* answer = getResumePacket(offset, &answerSize);
+    // the answer may have arrived with only its ack lost, so the data is still waited for
+    if (llwriteConnection(bond->links[0], answer, answerSize) == -1) printf("The answer to the start packet was not acknowledged\n");
+    free(answer);
+}
+
+    struct timeval start_total_time, end_total_time;
+
+    double elapsed_total_time;
+
+// Roles: "tx" sends the file and "rx" receives it. In a full duplex session "txrx"
+// opens the link and "rxtx" answers it; both send "filename" and receive the peer's.
 void applicationLayer(const char* serialPort, const char* role, int baudRate,
                       int nTries, int timeout, const char* filename) {
+    int duplex = !strcmp(role, "txrx") || !strcmp(role, "rxtx");
     LinkLayer linkLayer;
-    strcpy(linkLayer.serialPort, serialPort);
-    linkLayer.role = strcmp(role, "tx") ? LlRx : LlTx;
+    memset(&linkLayer, 0, sizeof(linkLayer));
+    linkLayer.role = strncmp(role, "tx", 2) ? LlRx : LlTx;
     linkLayer.baudRate = baudRate;
     linkLayer.nRetransmissions = nTries;
     linkLayer.timeout = timeout;
+    linkLayer.timeoutMs = timeout * 1000;
+    linkLayer.arqMode = ArqSelectiveRepeat;
+    linkLayer.windowSize = DEFAULT_WINDOW_SIZE;
+    linkLayer.frameCheck = CheckCrc32c;
+    linkLayer.fullDuplex = duplex;
+    linkLayer.maxFramePayload = MAX_LARGE_PAYLOAD_SIZE;
+    linkLayer.fecParity = FEC_PARITY;
 
-    int fd;
-    if ((fd = llopen(linkLayer)) < 0) {
+    Bond* bond = (Bond* )calloc(1, sizeof(Bond));
+    pthread_mutex_init(&bond->lock, NULL);
+    pthread_cond_init(&bond->changed, NULL);
+    if (openLinks(bond, linkLayer, serialPort) < 0) {
         perror("Connection error\n");
         exit(-1);
     }
     printf("llopen done\n");
 
-    switch (linkLayer.role) {
-        case LlTx: {
-            FILE *file = fopen(filename, "rb");
-            if (file == NULL) {
-                perror("File not found\n");
-                exit(-1);
-            }
+    LinkWorker senders[MAX_LINKS];
+    LinkWorker receivers[MAX_LINKS];
+    pthread_t sendThreads[MAX_LINKS];
+    pthread_t receiveThreads[MAX_LINKS];
+    memset(senders, 0, sizeof(senders));
+    memset(receivers, 0, sizeof(receivers));
+    for (int i = 0; i < bond->nLinks; i++) {
+        senders[i].bond = receivers[i].bond = bond;
+        senders[i].link = receivers[i].link = i;
+    }
+    int sending = linkLayer.role == LlTx || duplex;
+    int receiving = linkLayer.role == LlRx || duplex;
+    // both ends of a full duplex session may run in one directory, each names its copy after its role
+    char output[64] = "penguin-received.gif";
+    if (duplex) snprintf(output, sizeof(output), "penguin-received-%s.gif", role);
 
-            int prev = ftell(file);
-            fseek(file, 0L, SEEK_END);
-            long int fileSize = ftell(file) - prev;
-            fseek(file, prev, SEEK_SET);
-
-            printf("File size: %ld\n", fileSize);
-            unsigned int cpSize;
-            unsigned char* controlPacketStart = getControlPacket(2, filename, fileSize, &cpSize);
-            
-            if (llwrite(fd, controlPacketStart, cpSize) == -1) { // send start packet
-                printf("Exit: error in start packet\n");
-                exit(-1);
-            }
+    // start packets: the side that opened the link goes first
+    if (linkLayer.role == LlTx) {
+        openSource(bond, filename);
+        sendStartPacket(bond, filename);
+        if (duplex) readStartPacket(bond, output);
+    }
+    else {
+        readStartPacket(bond, output);
+        if (duplex) {
+            openSource(bond, filename);
+            sendStartPacket(bond, filename);
+        }
+    }
 
-            printf("Start packet sent\n");
-
-            unsigned char sequence = 0;
-            unsigned char* content = getData(file, fileSize);
-            long int bytesLeft = fileSize;
-            int k = 0;
-            gettimeofday(&start_total_time, NULL); //start total time
-
-            while (bytesLeft >= 0) {
-                int dataSize = bytesLeft > (long int)MAX_PAYLOAD_SIZE ? MAX_PAYLOAD_SIZE : bytesLeft;
-                unsigned char* data = (unsigned char* )malloc(dataSize);
-                memcpy(data, content, dataSize);
-
-                int packetSize;
-                unsigned char* packet = getDataPacket(sequence, data, dataSize, &packetSize);
-                gettimeofday(&start_packet_time, NULL);
-                if (llwrite(fd, packet, packetSize) == -1) { // send data packet
-                    printf("Exit: error in data packets\n");
-                    exit(-1);
-                }
-                gettimeofday(&end_packet_time, NULL);
-
-                elapsed_packet_time[k] = (end_packet_time.tv_sec - start_packet_time.tv_sec) + 
-                   (end_packet_time.tv_usec - start_packet_time.tv_usec) / 1e6;
-                k++;
-                bytesLeft -= (long int)MAX_PAYLOAD_SIZE;
-                content += dataSize;
-                sequence = (sequence + 1) % 255;
-            }
-            gettimeofday(&end_total_time, NULL); // Record the ending time
-            elapsed_total_time = (end_total_time.tv_sec - start_total_time.tv_sec) + 
-                   (end_total_time.tv_usec - start_total_time.tv_usec) / 1e6;
+    if (receiving) {
+        // the data packets of every link are read until the transmitter closes it
+        for (int i = 0; i < bond->nLinks; i++) pthread_create(&receiveThreads[i], NULL, receivePackets, &receivers[i]);
+    }
 
-            printf("File sent!\n");
+    if (sending) {
+        gettimeofday(&start_total_time, NULL); //start total time
+        for (int i = 0; i < bond->nLinks; i++) pthread_create(&sendThreads[i], NULL, sendPackets, &senders[i]);
+    }
 
-            unsigned char* controlPacketEnd = getControlPacket(3, filename, fileSize, &cpSize);
-            if (llwrite(fd, controlPacketEnd, cpSize) == -1) { // send disconnect packet
-                printf("Exit: error in end packet\n");
-                exit(-1);
-            }
+    if (receiving) {
+        long int written = closeOutput(bond);
+        if (bond->receiveFailed) {
+            printf("Exit: error in data packets\n");
+            exit(-1);
+        }
+        if (written < bond->expectedSize) {
+            printf("Exit: transfer cut short\n");
+            exit(-1);
+        }
+        printf("File received!\n");
+    }
 
-            if(llclose(fd, 0) == -1){
-                printf("Exit: error in llclose\n");
-                exit(-1);
-            };
-            double mean = 0;
-            for(int i = 0; i < k; i++){
-                mean += elapsed_packet_time[i];
-                printf("Packet %d time: %fs\n", i, elapsed_packet_time[i]);
-            }
-            mean /= k;
-            printf("Mean packet transmisson time: %fs\n", mean);
-            printf("Total file transmission time = %fs\n", elapsed_total_time);
-            printf("Disconnecting\n");
-            break;
+    if (sending) {
+        int failed = FALSE;
+        for (int i = 0; i < bond->nLinks; i++) {
+            pthread_join(sendThreads[i], NULL);
+            failed |= senders[i].failed;
+        }
+        closeSource(bond);
+        if (failed) {
+            printf("Exit: error in data packets\n");
+            exit(-1);
         }
+        printf("File sent!\n");
+    }
 
-        case LlRx: {
-            unsigned char* packet = (unsigned char* )malloc(MAX_PAYLOAD_SIZE);
-            int packetSize = -1;
-            
-            while ((packetSize = llread(fd, packet)) < 0); // wait for start packet
-            printf("Start packet received\n");
-            int nameSize = 0;
-            parseControlPacket(packet, packetSize, &nameSize);
+    if (linkLayer.role == LlTx) {
+        unsigned int cpSize;
+        unsigned char* controlPacketEnd = getControlPacket(PACKET_END, filename, bond->fileSize, bond->compress, FALSE, &cpSize);
+        if (llwriteConnection(bond->links[0], controlPacketEnd, cpSize) == -1) { // send disconnect packet
+            printf("Exit: error in end packet\n");
+            exit(-1);
+        }
+        free(controlPacketEnd);
 
-            FILE *newFile = fopen((char* )"penguin-received.gif", "wb+");
-            if (newFile == NULL) {
-                perror("File not found\n");
+        // the receiving threads return once their link is closed
+        for (int i = 0; i < bond->nLinks; i++) {
+            if (llcloseConnection(bond->links[i], SHOW_STATISTICS) == -1) {
+                printf("Exit: error in llclose\n");
                 exit(-1);
             }
-            while (1) {
-                packetSize = -1;
-                while ((packetSize = llread(fd, packet)) < 0); // wait for data packet
-                if (!packetSize) break;
-                else if (packet[0] != 3) {
-                    unsigned char* buffer = (unsigned char* )malloc(packetSize);
-                    parseDataPacket(packet, packetSize, buffer);
-                    fwrite(buffer, sizeof(unsigned char), packetSize - 5, newFile);
-                    free(buffer);
-                }
-                else break;
-            }
-            printf("File received!\n");
-
-            fclose(newFile);
-            int disc = -1;
-            while ((disc = llread(fd, packet)) < 0); // wait for disconnect packet
-            printf("Disconnecting\n");
-            break;
         }
-        
-        default:
-            exit(-1);
-            break;
+        if (receiving) {
+            for (int i = 0; i < bond->nLinks; i++) pthread_join(receiveThreads[i], NULL);
+        }
+    }
+    else {
+        for (int i = 0; i < bond->nLinks; i++) {
+            pthread_join(receiveThreads[i], NULL);
+            if (receivers[i].failed) printf("Link %d failed\n", i);
         }
+        for (int i = 0; i < bond->nLinks; i++) llcloseConnection(bond->links[i], SHOW_STATISTICS);
+    }
+
+    if (sending) {
+        // the send threads return with the last frames still in the window, the file is
+        // only sent once llclose saw them acknowledged
+        gettimeofday(&end_total_time, NULL); // Record the ending time
+        elapsed_total_time = (end_total_time.tv_sec - start_total_time.tv_sec) +
+               (end_total_time.tv_usec - start_total_time.tv_usec) / 1e6;
+        long int packets = 0;
+        long int dataBytes = 0;
+        double elapsed = 0;
+        for (int i = 0; i < bond->nLinks; i++) {
+            packets += senders[i].packets;
+            dataBytes += senders[i].dataBytes;
+            elapsed += senders[i].elapsed;
+            if (bond->nLinks > 1) printf("Link %d: %ld packets sent\n", i, senders[i].packets);
+        }
+        printf("Mean packet transmisson time: %fs\n", packets > 0 ? elapsed / packets : 0);
+        if (bond->fileSize > 0) printf("Data sent: %ld bytes (%.1f%% of the file)\n", dataBytes, 100.0 * dataBytes / bond->fileSize);
+        printf("Total file transmission time = %fs\n", elapsed_total_time);
+        if (elapsed_total_time > 0) printf("Throughput: %.0f bytes/s\n", bond->fileSize / elapsed_total_time);
+    }
+    if (receiving && bond->nLinks > 1) {
+        for (int i = 0; i < bond->nLinks; i++) printf("Link %d: %ld packets received\n", i, receivers[i].packets);
+    }
+    printf("Disconnecting\n");
 }
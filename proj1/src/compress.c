@@ -0,0 +1,118 @@
+// Packet compression implementation.
+// LZ77 in the style of LZ4: a sequence is a token (literal length << 4 | match length - 4),
+// the literals, a 2 byte offset and the match. Lengths of 15 or more go on in extra
+// bytes of 255. The last sequence has only literals.
+// Matches are found with a hash table of the last position of every 4 byte prefix.
+
+#include "compress.h"
+#include <stdint.h>
+#include <string.h>
+
+#define MIN_MATCH 4
+#define MAX_OFFSET 65535
+#define HASH_BITS 12
+
+static inline uint32_t read32(const unsigned char *p) {
+    uint32_t value;
+    memcpy(&value, p, 4);
+    return value;
+}
+
+static inline int hash(uint32_t value) {
+    return (value * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// Writes the extra bytes of a length of 15 or more. Returns the new position or -1.
+static int putLength(unsigned char *out, int pos, int capacity, int length) {
+    for (length -= 15; length >= 255; length -= 255) {
+        if (pos >= capacity) return -1;
+        out[pos++] = 255;
+    }
+    if (pos >= capacity) return -1;
+    out[pos++] = length;
+    return pos;
+}
+
+// Writes the literals in[anchor, end) and, if matchLength > 0, the match after them.
+static int putSequence(const unsigned char *in, int anchor, int end, int offset, int matchLength,
+                       unsigned char *out, int pos, int capacity) {
+    int literals = end - anchor;
+    int matchCode = matchLength > 0 ? matchLength - MIN_MATCH : 0;
+
+    if (pos >= capacity) return -1;
+    out[pos++] = (literals < 15 ? literals : 15) << 4 | (matchCode < 15 ? matchCode : 15);
+    if (literals >= 15 && (pos = putLength(out, pos, capacity, literals)) < 0) return -1;
+    if (pos + literals > capacity) return -1;
+    memcpy(out + pos, in + anchor, literals);
+    pos += literals;
+    if (matchLength == 0) return pos;
+
+    if (pos + 2 > capacity) return -1;
+    out[pos++] = offset & 0xFF;
+    out[pos++] = offset >> 8;
+    if (matchCode >= 15 && (pos = putLength(out, pos, capacity, matchCode)) < 0) return -1;
+    return pos;
+}
+
+int lzCompress(const unsigned char *in, int n, unsigned char *out, int capacity) {
+    int table[1 << HASH_BITS];
+    int pos = 0;
+    int anchor = 0;
+    int i = 0;
+
+    memset(table, 0xFF, sizeof(table));
+    while (i + MIN_MATCH <= n) {
+        uint32_t prefix = read32(in + i);
+        int h = hash(prefix);
+        int candidate = table[h];
+        table[h] = i;
+        if (candidate < 0 || i - candidate > MAX_OFFSET || read32(in + candidate) != prefix) {
+            i++;
+            continue;
+        }
+
+        int length = MIN_MATCH;
+        while (i + length < n && in[candidate + length] == in[i + length]) length++;
+        if ((pos = putSequence(in, anchor, i, i - candidate, length, out, pos, capacity)) < 0) return -1;
+        i += length;
+        anchor = i;
+    }
+    return putSequence(in, anchor, n, 0, 0, out, pos, capacity);
+}
+
+// Reads a length of 15 or more. Returns it, or -1 past the end of the input.
+static int getLength(const unsigned char *in, int n, int *pos, int length) {
+    if (length < 15) return length;
+    for (;;) {
+        if (*pos >= n) return -1;
+        unsigned char extra = in[(*pos)++];
+        length += extra;
+        if (extra != 255) return length;
+    }
+}
+
+int lzDecompress(const unsigned char *in, int n, unsigned char *out, int capacity) {
+    int pos = 0;
+    int size = 0;
+
+    while (pos < n) {
+        unsigned char token = in[pos++];
+        int literals = getLength(in, n, &pos, token >> 4);
+        if (literals < 0 || pos + literals > n || size + literals > capacity) return -1;
+        memcpy(out + size, in + pos, literals);
+        pos += literals;
+        size += literals;
+        if (pos == n) return size; // the last sequence
+
+        if (pos + 2 > n) return -1;
+        int offset = in[pos] | in[pos + 1] << 8;
+        pos += 2;
+        int length = getLength(in, n, &pos, token & 0x0F);
+        if (length < 0 || offset == 0 || offset > size) return -1;
+        length += MIN_MATCH;
+        if (size + length > capacity) return -1;
+        // the match may overlap the bytes it produces
+        for (int i = 0; i < length; i++, size++) out[size] = out[size - offset];
+    }
+    return size;
+}
@@ -0,0 +1,177 @@
+// Forward error correction implementation.
+// Reed-Solomon over GF(256) (polynomial 0x11D, roots 1, a, a^2, ...) with shortened
+// blocks of up to 255 bytes, interleaved byte by byte over the whole frame.
+// Decoding uses Berlekamp-Massey, a Chien search and Forney's formula.
+
+#include "fec.h"
+#include <pthread.h>
+#include <string.h>
+
+#define FEC_BLOCK 255
+
+static unsigned char gfExp[2 * FEC_BLOCK];
+static unsigned char gfLog[256];
+static pthread_once_t ready = PTHREAD_ONCE_INIT;
+
+static void initFec() {
+    int x = 1;
+    for (int i = 0; i < FEC_BLOCK; i++) {
+        gfExp[i] = x;
+        gfExp[i + FEC_BLOCK] = x;
+        gfLog[x] = i;
+        x <<= 1;
+        if (x & 0x100) x ^= 0x11D;
+    }
+}
+
+static inline unsigned char gfMul(unsigned char a, unsigned char b) {
+    return a && b ? gfExp[gfLog[a] + gfLog[b]] : 0;
+}
+
+static inline unsigned char gfDiv(unsigned char a, unsigned char b) {
+    return a ? gfExp[gfLog[a] + FEC_BLOCK - gfLog[b]] : 0;
+}
+
+// Generator polynomial (x - 1)(x - a)...(x - a^(parity-1)), highest degree first.
+static void generator(int parity, unsigned char *g) {
+    memset(g, 0, parity + 1);
+    g[0] = 1;
+    for (int i = 0; i < parity; i++) {
+        for (int j = i + 1; j > 0; j--) g[j] ^= gfMul(g[j - 1], gfExp[i]);
+    }
+}
+
+// Systematic parity of one block: the remainder of msg(x) * x^parity divided by g(x).
+static void encodeBlock(const unsigned char *msg, int n, const unsigned char *g, int parity, unsigned char *out) {
+    memset(out, 0, parity);
+    for (int i = 0; i < n; i++) {
+        unsigned char feedback = msg[i] ^ out[0];
+        memmove(out, out + 1, parity - 1);
+        out[parity - 1] = 0;
+        if (feedback) {
+            int log = gfLog[feedback];
+            for (int j = 0; j < parity; j++) {
+                if (g[j + 1]) out[j] ^= gfExp[log + gfLog[g[j + 1]]];
+            }
+        }
+    }
+}
+
+// Corrects one block of n bytes (message and parity) in place.
+// Returns the number of bytes corrected, or -1 if it cannot be corrected.
+static int decodeBlock(unsigned char *block, int n, int parity) {
+    unsigned char syndromes[MAX_FEC_PARITY];
+    unsigned char any = 0;
+
+    for (int j = 0; j < parity; j++) {
+        unsigned char s = 0;
+        for (int i = 0; i < n; i++) s = gfMul(s, gfExp[j]) ^ block[i];
+        syndromes[j] = s;
+        any |= s;
+    }
+    if (any == 0) return 0;
+
+    // Berlekamp-Massey: error locator "locator", lowest degree first
+    unsigned char locator[MAX_FEC_PARITY + 1] = {1};
+    unsigned char previous[MAX_FEC_PARITY + 1] = {1};
+    unsigned char copy[MAX_FEC_PARITY + 1];
+    int errors = 0;
+    int shift = 1;
+    unsigned char lastDiscrepancy = 1;
+
+    for (int k = 0; k < parity; k++) {
+        unsigned char d = syndromes[k];
+        for (int i = 1; i <= errors; i++) d ^= gfMul(locator[i], syndromes[k - i]);
+        if (d == 0) {
+            shift++;
+            continue;
+        }
+        unsigned char scale = gfDiv(d, lastDiscrepancy);
+        memcpy(copy, locator, sizeof(locator));
+        for (int i = 0; i + shift <= parity; i++) locator[i + shift] ^= gfMul(scale, previous[i]);
+        if (2 * errors <= k) {
+            errors = k + 1 - errors;
+            memcpy(previous, copy, sizeof(previous));
+            lastDiscrepancy = d;
+            shift = 1;
+        }
+        else shift++;
+    }
+    if (2 * errors > parity) return -1;
+
+    // evaluator: syndromes(x) * locator(x) mod x^parity
+    unsigned char evaluator[MAX_FEC_PARITY];
+    for (int i = 0; i < parity; i++) {
+        unsigned char e = 0;
+        for (int j = 0; j <= i && j <= errors; j++) e ^= gfMul(locator[j], syndromes[i - j]);
+        evaluator[i] = e;
+    }
+
+    // Chien search: byte i has the power n - 1 - i, it is wrong if locator(X^-1) == 0
+    int found = 0;
+    for (int i = 0; i < n && found < errors; i++) {
+        int power = n - 1 - i;
+        int inverse = (FEC_BLOCK - power) % FEC_BLOCK;
+        unsigned char value = 0;
+        for (int j = errors; j >= 0; j--) value = gfMul(value, gfExp[inverse]) ^ locator[j];
+        if (value != 0) continue;
+
+        // Forney: magnitude = X * evaluator(X^-1) / locator'(X^-1)
+        unsigned char numerator = 0;
+        for (int j = parity - 1; j >= 0; j--) numerator = gfMul(numerator, gfExp[inverse]) ^ evaluator[j];
+        unsigned char denominator = 0;
+        for (int j = 1; j <= errors; j += 2) denominator ^= gfMul(locator[j], gfExp[(inverse * (j - 1)) % FEC_BLOCK]);
+        if (denominator == 0) return -1;
+        block[i] ^= gfMul(gfExp[power], gfDiv(numerator, denominator));
+        found++;
+    }
+    return found == errors ? errors : -1;
+}
+
+// Byte i of the data belongs to block i % blocks. The parity follows with the same stride,
+// so any run of bytes, data or parity, is spread evenly over the blocks.
+static inline int parityPosition(int n, int blocks, int block, int j) {
+    return n + (block - n % blocks + blocks) % blocks + j * blocks;
+}
+
+int fecEncode(const unsigned char *data, int n, const unsigned char *trailer, int trailerSize, int parity, unsigned char *out) {
+    pthread_once(&ready, initFec);
+    int size = n + trailerSize;
+    int blocks = (size + FEC_BLOCK - parity - 1) / (FEC_BLOCK - parity);
+    unsigned char g[MAX_FEC_PARITY + 1];
+    unsigned char msg[FEC_BLOCK];
+    unsigned char check[MAX_FEC_PARITY];
+
+    generator(parity, g);
+    for (int b = 0; b < blocks; b++) {
+        int length = 0;
+        for (int i = b; i < size; i += blocks) msg[length++] = i < n ? data[i] : trailer[i - n];
+        encodeBlock(msg, length, g, parity, check);
+        for (int j = 0; j < parity; j++) out[parityPosition(n + trailerSize, blocks, b, j) - size] = check[j];
+    }
+    return blocks * parity;
+}
+
+int fecDecode(unsigned char *data, int size, int parity, int *corrected) {
+    pthread_once(&ready, initFec);
+    int blocks = (size + FEC_BLOCK - 1) / FEC_BLOCK;
+    int n = size - blocks * parity;
+    unsigned char block[FEC_BLOCK];
+
+    *corrected = 0;
+    if (n < blocks) return -1;
+    for (int b = 0; b < blocks; b++) {
+        int length = 0;
+        for (int i = b; i < n; i += blocks) block[length++] = data[i];
+        for (int j = 0; j < parity; j++) block[length++] = data[parityPosition(n, blocks, b, j)];
+
+        int fixed = decodeBlock(block, length, parity);
+        if (fixed < 0) return -1;
+        if (fixed == 0) continue;
+        *corrected += fixed;
+        length = 0;
+        for (int i = b; i < n; i += blocks) data[i] = block[length++];
+        for (int j = 0; j < parity; j++) data[parityPosition(n, blocks, b, j)] = block[length++];
+    }
+    return n;
+}
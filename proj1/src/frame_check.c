@@ -0,0 +1,170 @@
+// Frame check implementation.
+// XOR fold a word (or a vector) at a time, CRC-16-CCITT and CRC-32C with slicing-by-8
+// tables, and CRC-32C with the SSE4.2 crc32 instruction when the CPU has it.
+
+#include "frame_check.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CHECK_X86 1
+#endif
+
+static uint16_t crc16Table[8][256];
+static uint32_t crc32cTable[8][256];
+static pthread_once_t ready = PTHREAD_ONCE_INIT;
+static int hasAVX2 = FALSE;
+static int hasSSE42 = FALSE;
+
+static void initFrameCheck() {
+    for (int i = 0; i < 256; i++) {
+        uint16_t crc16 = i << 8;
+        uint32_t crc32 = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc16 = crc16 & 0x8000 ? (crc16 << 1) ^ 0x1021 : crc16 << 1;
+            crc32 = crc32 & 1 ? (crc32 >> 1) ^ 0x82F63B78 : crc32 >> 1;
+        }
+        crc16Table[0][i] = crc16;
+        crc32cTable[0][i] = crc32;
+    }
+    // table k holds the CRC of a byte followed by k zero bytes
+    for (int k = 1; k < 8; k++) {
+        for (int i = 0; i < 256; i++) {
+            uint16_t crc16 = crc16Table[k - 1][i];
+            uint32_t crc32 = crc32cTable[k - 1][i];
+            crc16Table[k][i] = (crc16 << 8) ^ crc16Table[0][crc16 >> 8];
+            crc32cTable[k][i] = (crc32 >> 8) ^ crc32cTable[0][crc32 & 0xFF];
+        }
+    }
+#ifdef CHECK_X86
+    __builtin_cpu_init();
+    hasAVX2 = __builtin_cpu_supports("avx2");
+    hasSSE42 = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+static unsigned char xorFoldWords(const unsigned char *data, int n) {
+    uint64_t acc = 0;
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        acc ^= word;
+    }
+    acc ^= acc >> 32;
+    acc ^= acc >> 16;
+    acc ^= acc >> 8;
+    unsigned char bcc = acc & 0xFF;
+    for (; i < n; i++) bcc ^= data[i];
+    return bcc;
+}
+
+#ifdef CHECK_X86
+__attribute__((target("avx2")))
+static unsigned char xorFoldAVX2(const unsigned char *data, int n) {
+    __m256i acc = _mm256_setzero_si256();
+    int i = 0;
+    for (; i + 32 <= n; i += 32) {
+        acc = _mm256_xor_si256(acc, _mm256_loadu_si256((const __m256i *)(data + i)));
+    }
+    __m128i half = _mm_xor_si128(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    uint64_t word = (uint64_t)_mm_cvtsi128_si64(half) ^ (uint64_t)_mm_cvtsi128_si64(_mm_unpackhi_epi64(half, half));
+    word ^= word >> 32;
+    word ^= word >> 16;
+    word ^= word >> 8;
+    return (word & 0xFF) ^ xorFoldWords(data + i, n - i);
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32cSSE42(uint32_t crc, const unsigned char *data, int n) {
+    int i = 0;
+#ifdef __x86_64__
+    uint64_t crc64 = crc;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = (uint32_t)crc64;
+#endif
+    for (; i < n; i++) crc = _mm_crc32_u8(crc, data[i]);
+    return crc;
+}
+#endif
+
+static uint32_t crc32cSlicing(uint32_t crc, const unsigned char *data, int n) {
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        const unsigned char *p = data + i;
+        crc ^= p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+        crc = crc32cTable[7][crc & 0xFF] ^ crc32cTable[6][(crc >> 8) & 0xFF] ^
+              crc32cTable[5][(crc >> 16) & 0xFF] ^ crc32cTable[4][crc >> 24] ^
+              crc32cTable[3][p[4]] ^ crc32cTable[2][p[5]] ^
+              crc32cTable[1][p[6]] ^ crc32cTable[0][p[7]];
+    }
+    for (; i < n; i++) crc = (crc >> 8) ^ crc32cTable[0][(crc ^ data[i]) & 0xFF];
+    return crc;
+}
+
+unsigned char xorFold(const unsigned char *data, int n) {
+    pthread_once(&ready, initFrameCheck);
+#ifdef CHECK_X86
+    if (hasAVX2) return xorFoldAVX2(data, n);
+#endif
+    return xorFoldWords(data, n);
+}
+
+unsigned short crc16Ccitt(const unsigned char *data, int n) {
+    pthread_once(&ready, initFrameCheck);
+    uint16_t crc = 0xFFFF;
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        const unsigned char *p = data + i;
+        crc = crc16Table[7][p[0] ^ (crc >> 8)] ^ crc16Table[6][p[1] ^ (crc & 0xFF)] ^
+              crc16Table[5][p[2]] ^ crc16Table[4][p[3]] ^
+              crc16Table[3][p[4]] ^ crc16Table[2][p[5]] ^
+              crc16Table[1][p[6]] ^ crc16Table[0][p[7]];
+    }
+    for (; i < n; i++) crc = (crc << 8) ^ crc16Table[0][(crc >> 8) ^ data[i]];
+    return crc;
+}
+
+unsigned int crc32c(const unsigned char *data, int n) {
+    pthread_once(&ready, initFrameCheck);
+#ifdef CHECK_X86
+    if (hasSSE42) return ~crc32cSSE42(0xFFFFFFFF, data, n);
+#endif
+    return ~crc32cSlicing(0xFFFFFFFF, data, n);
+}
+
+int frameCheckSize(FrameCheck check) {
+    switch (check) {
+        case CheckCrc16: return 2;
+        case CheckCrc32c: return 4;
+        default: return 1;
+    }
+}
+
+void frameCheckCompute(FrameCheck check, const unsigned char *data, int n, unsigned char *out) {
+    switch (check) {
+        case CheckCrc16: {
+            unsigned short crc = crc16Ccitt(data, n);
+            out[0] = crc >> 8;
+            out[1] = crc & 0xFF;
+            break;
+        }
+        case CheckCrc32c: {
+            unsigned int crc = crc32c(data, n);
+            out[0] = crc >> 24;
+            out[1] = (crc >> 16) & 0xFF;
+            out[2] = (crc >> 8) & 0xFF;
+            out[3] = crc & 0xFF;
+            break;
+        }
+        default:
+            out[0] = xorFold(data, n);
+            break;
+    }
+}
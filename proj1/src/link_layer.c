@@ -1,6 +1,17 @@
 // Link layer protocol implementation
 
 #include "link_layer.h"
+#include "stuffing.h"
+#include "frame_check.h"
+#include "fec.h"
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
 
 // MISC
 #define _POSIX_SOURCE 1 // POSIX compliant source
@@ -10,7 +21,6 @@
 #define FRAME_CONTROL(Ns) (Ns << 6)
 #define RR(Nr) ((Nr << 7) | 0x05)
 #define REJECT(Nr) ((Nr << 7) | 0x01)
-#define BUF_SIZE 5
 #define FLAG 0x7E
 #define A_TR 0x03
 #define A_REC 0x01
@@ -19,41 +29,287 @@
 #define C_DISC 0x0B
 #define ESC 0x7D
 
-enum States {
-    START,
-    FLAG_RCV,
-    A_RCV,
-    C_RCV,
-    CP_RCV,
-    BCC_OK,
-    BCC1_OK,
-    PAYLOAD,
-    CHECK_BCC2,
-    BCC2_OK,
-    STOP_MACHINE,
-    STOP_MACHINE_DISC
+// Extended frames, used once negotiated in llopen.
+// The header carries a full sequence byte after C: FLAG A C N BCC1 ...
+#define C_IX 0x20
+#define C_RRX 0x25
+#define C_REJX 0x21
+#define C_SREJX 0x2D
+#define SEQ_MOD_EXT 256
+// Full duplex I-frame, acknowledging the peer's frames too: FLAG A C Ns Nr BCC1 ...
+#define C_IXA 0x22
+
+// Parameters carried in the extended SET / UA as (type, length, value)
+#define PARAM_ARQ 0
+#define PARAM_WINDOW 1
+#define PARAM_CHECK 2
+#define PARAM_DUPLEX 3
+#define PARAM_FRAME 4 // largest llwrite, 2 bytes
+#define PARAM_FEC 5   // Reed-Solomon parity bytes per block of I-frame data, 0 for none
+
+// Application data packets carry a 4 byte header on top of MAX_PAYLOAD_SIZE.
+// Larger frames are used once negotiated in llopen.
+#define MAX_FRAME_PAYLOAD (MAX_PAYLOAD_SIZE + 4)
+#define MAX_HEADER_SIZE 5 // A C Ns Nr BCC1
+// check and FEC parity of the data
+#define FRAME_TAIL_SIZE(payload, parity) (MAX_FRAME_CHECK_SIZE + FEC_PARITY_SIZE((payload) + MAX_FRAME_CHECK_SIZE, parity))
+// header, data, check and parity, before stuffing
+#define FRAME_BODY_SIZE(payload, parity) (MAX_HEADER_SIZE + (payload) + FRAME_TAIL_SIZE(payload, parity))
+// SET / UA with parameters and supervision frames
+#define MAX_PARAMS_SIZE 32
+#define MAX_CONTROL_FRAME (STUFFED_MAX_SIZE(MAX_HEADER_SIZE + MAX_PARAMS_SIZE + 1) + 2)
+#define RX_RING_SIZE 4096
+
+// Retransmission timeout estimator (RFC 6298), in milliseconds.
+// The configured timeout is the initial value and the ceiling of the backoff.
+#define RTO_MIN_MS 20
+#define RTO_ALPHA 0.125
+#define RTO_BETA 0.25
+// An open connection with no timer armed gives up on the peer after this many
+// configured timeouts without a byte from it.
+#define IDLE_TIMEOUTS 10
+
+typedef struct {
+    unsigned char a;
+    unsigned char c;
+    unsigned char n;
+    unsigned char nr; // piggybacked acknowledgement of C_IXA frames
+    unsigned char* data;
+    int dataSize;
+    int bcc2Ok;
+} Frame;
+
+// I-frame as it goes on the wire: FLAG and stuffed header, stuffed data, stuffed check and FLAG.
+// The pieces are sent together with writev() and kept for retransmissions.
+typedef struct {
+    unsigned char head[1 + STUFFED_MAX_SIZE(MAX_HEADER_SIZE)];
+    unsigned char* body; // STUFFED_MAX_SIZE of the largest payload
+    unsigned char* tail; // STUFFED_MAX_SIZE of the largest check and parity, and FLAG
+    struct iovec iov[3];
+    int size;
+} EncodedFrame;
+
+typedef struct {
+    EncodedFrame frame;
+    unsigned char a, c, n; // to encode the header again with the current Nr
+    double sentAt;     // ms, for RTT samples
+    int queuedBytes;   // bytes still in the output queue right after it was written
+    int retransmitted; // Karn: no RTT sample from retransmitted frames
+} TxSlot;
+
+// out of order frame kept by the selective repeat receiver
+typedef struct {
+    unsigned char* data; // the largest payload
+    int size;
+    int present;
+    int srejSent;
+    int srejOrder; // number of the SREJ that asked for it last
+} RxSlot;
+
+// Link options agreed in llopen
+typedef struct {
+    ArqMode arqMode;
+    int windowSize;
+    FrameCheck frameCheck;
+    int fullDuplex;
+    int maxPayload;
+    int fecParity;
+} LinkParams;
+
+typedef enum {
+    AckRR,
+    AckREJ,
+    AckSREJ,
+} AckKind;
+
+// State of one connection. Every function below works on the connection it is given,
+// so several links can be driven from one process, each from its own thread.
+// One thread may write while another reads the same connection: the lock is held by
+// every call, except while waiting on the port, and whichever call is waiting
+// processes every frame that arrives (see pump).
+struct LinkConnection {
+    int fd;
+    LinkLayerRole role;
+    pthread_mutex_t lock;
+    pthread_cond_t changed; // a frame or timeout was processed
+    int pumping;            // a call is waiting on the port
+    int wakeFd;             // eventfd that wakes the call waiting on the port
+    int users;              // llread / llwrite calls in progress
+    int failed;             // port error, or nothing heard from the peer for too long
+    int writeFailed;        // retransmissions exhausted: llwrite fails, llread goes on
+    int tramaTr; // next Ns to send
+    int tramaRc; // next Ns expected
+    int timeoutMs;
+    int nRetransmissions;
+    int lineBps;
+
+    // adaptive retransmission timeout
+    double srtt;
+    double rttvar;
+    int rttValid;
+    int rtoMs;
+    int backoff; // timeouts since the last valid sample, each one doubles the RTO
+
+    // retransmission timer, waited on with poll() together with the serial port
+    int timerFd;
+    int timerArmed;
+    int timeoutCount; // consecutive timeouts at the configured timeout without progress
+    int timeouts;     // every expiration of the timer
+
+    // negotiated mode
+    ArqMode arqMode;
+    int windowSize;
+    FrameCheck frameCheck;
+    int seqMod;
+    int extendedFrames;
+    int fullDuplex; // I-frames carry Nr
+    int maxPayload; // largest frame data either end sends
+    int fecParity;  // Reed-Solomon parity bytes per block of I-frame data
+    LinkParams local; // what this end proposes / accepts
+    // frame buffers are sized for the largest payload this end accepts
+    int bufferPayload;
+    unsigned char* buffers;
+
+    // transmitter window: frames txBase .. txBase + txCount - 1 are not acknowledged
+    TxSlot txWindow[MAX_WINDOW_SIZE];
+    int txBase;
+    int txCount;
+
+    // receiver: every read() takes all bytes available into rxRing, which the frame
+    // parser consumes; bytes past the end of a frame are kept for the next one
+    unsigned char rxRing[RX_RING_SIZE];
+    int rxHead;
+    int rxTail;
+    // the frame is destuffed and checked as its bytes arrive
+    unsigned char* rxFrame; // FRAME_BODY_SIZE(bufferPayload, local.fecParity)
+    int rxPos;
+    int rxInFrame;
+    int rxEscaped;
+    unsigned char rxCheck; // XOR of every destuffed byte of the frame, for the BCC2
+    int rejSent;
+    int ackPending; // frames accepted but not acknowledged yet
+    RxSlot rxWindow[MAX_WINDOW_SIZE];
+    // frames accepted while no llread was waiting for them
+    RxSlot rxQueue[MAX_WINDOW_SIZE];
+    int rxQueueHead;
+    int rxQueueCount;
+    int discReceived; // the peer's DISC (or its answer to ours) arrived
+    int uaReceived;
+
+    // counters returned by llstatistics
+    double openedAt;
+    long framesSent;
+    long retransmissions;
+    long framesReceived;
+    long duplicates;
+    long rejectsSent;
+    int srejCount; // SREJs sent, to number them
+    long rejReceived;
+    long fecRepaired;
+    long dataSent;
+    long dataReceived;
+    long lineBytesSent;
+    long stuffingBytes;
+    long ackLatency[LATENCY_BUCKETS];
+    long writeLatency[LATENCY_BUCKETS];
+
+    double elapsed_2prop_time;
 };
 
-volatile int STOP = FALSE;
-int alarmEnabled = FALSE;
-int alarmCount = 0;
-int tramaTr = 0;
-int tramaRc = 1;
-int timeout;
-int nRetransmissions;
+const LinkParams legacyParams = {ArqStopAndWait, 1, CheckXor, FALSE, MAX_FRAME_PAYLOAD, 0};
+
+// connections opened through the fd based API
+#define MAX_FD_CONNECTIONS 64
+LinkConnection* fdConnections[MAX_FD_CONNECTIONS];
+pthread_mutex_t fdConnectionsLock = PTHREAD_MUTEX_INITIALIZER;
+
+
+double nowMs() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000.0 + now.tv_nsec / 1e6;
+}
+
+// Bucket of the latency histograms for "ms".
+int latencyBucket(double ms) {
+    int bucket = 0;
+    while (bucket < LATENCY_BUCKETS - 1 && ms >= (1 << bucket)) bucket++;
+    return bucket;
+}
+
+// Bits per second of the line, from either a plain number or a Bxxx constant.
+int lineBitsPerSecond(int baudRate) {
+    const int speeds[][2] = {
+        {B1200, 1200}, {B2400, 2400}, {B4800, 4800}, {B9600, 9600}, {B19200, 19200},
+        {B38400, 38400}, {B57600, 57600}, {B115200, 115200}, {B230400, 230400},
+    };
+    for (int i = 0; i < (int)(sizeof(speeds) / sizeof(speeds[0])); i++) {
+        if (speeds[i][0] == baudRate) return speeds[i][1];
+    }
+    return baudRate > 0 ? baudRate : 9600;
+}
+
+// Time the line takes to send "bytes" (8N1, 10 bits per byte).
+double txTimeMs(LinkConnection* conn, int bytes) {
+    return bytes * 10 * 1000.0 / conn->lineBps;
+}
+
+// Bytes written to the port that the line has not sent yet, as TIOCOUTQ reports them.
+// Pseudo terminals report none, and then the timers add nothing for the queue.
+int outputQueued(LinkConnection* conn) {
+    int bytes = 0;
+    if (ioctl(conn->fd, TIOCOUTQ, &bytes) < 0) bytes = 0;
+    return bytes;
+}
+
+// Updates SRTT / RTTVAR with a round trip (excluding serialization) and recomputes the RTO.
+void rttSample(LinkConnection* conn, double ms) {
+    if (ms < 0) ms = 0;
+    if (!conn->rttValid) {
+        conn->srtt = ms;
+        conn->rttvar = ms / 2;
+        conn->rttValid = TRUE;
+    }
+    else {
+        double delta = conn->srtt > ms ? conn->srtt - ms : ms - conn->srtt;
+        conn->rttvar = (1 - RTO_BETA) * conn->rttvar + RTO_BETA * delta;
+        conn->srtt = (1 - RTO_ALPHA) * conn->srtt + RTO_ALPHA * ms;
+    }
+    conn->rtoMs = (int)(conn->srtt + (4 * conn->rttvar > 1 ? 4 * conn->rttvar : 1) + 0.5);
+    if (conn->rtoMs < RTO_MIN_MS) conn->rtoMs = RTO_MIN_MS;
+    if (conn->rtoMs > conn->timeoutMs) conn->rtoMs = conn->timeoutMs;
+    conn->backoff = 0;
+}
 
+// The RTO doubled for every timeout since the last valid sample, up to the configured timeout.
+int backedOffRto(LinkConnection* conn) {
+    int ms = conn->rtoMs;
+    for (int i = 0; i < conn->backoff && ms < conn->timeoutMs; i++) ms *= 2;
+    return ms < conn->timeoutMs ? ms : conn->timeoutMs;
+}
 
+void setTimer(LinkConnection* conn, int ms) {
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = ms / 1000;
+    spec.it_value.tv_nsec = (long)(ms % 1000) * 1000000;
+    timerfd_settime(conn->timerFd, 0, &spec, NULL);
+    conn->timerArmed = ms > 0;
+}
 
+// Arms the retransmission timer for a frame just written, leaving time for the output
+// queue to drain.
+void startTimer(LinkConnection* conn) {
+    setTimer(conn, backedOffRto(conn) + (int)txTimeMs(conn, outputQueued(conn)));
+}
 
-void alarmHandler(int signal) {
-    alarmEnabled = FALSE;
-    alarmCount++;
-    printf("Alarm #%d\n", alarmCount);
+void stopTimer(LinkConnection* conn) {
+    setTimer(conn, 0);
 }
 
-void sendFrame(int fd, unsigned char *buf, int n) {
-    write(fd, buf, n);
-    alarm(timeout);
+void sendFrame(LinkConnection* conn, unsigned char *buf, int n) {
+    write(conn->fd, buf, n);
+    startTimer(conn);
 }
 
 int sendSup(int fd, unsigned char A, unsigned char C) {
@@ -61,54 +317,676 @@ int sendSup(int fd, unsigned char A, unsigned char C) {
     return write(fd, UA, 5);
 }
 
-unsigned char buildBCC2(const unsigned char* payload, int n) {
-    unsigned char bcc2 = payload[0];
-    for (int i = 1; i < n; i++) bcc2 = bcc2 ^ payload[i];
-    return bcc2;
+int hasSeq(unsigned char c) {
+    return c == C_IX || c == C_IXA || c == C_RRX || c == C_REJX || c == C_SREJX;
+}
+
+int hasAck(unsigned char c) {
+    return c == C_IXA;
+}
+
+// SET / UA keep the BCC2, they are exchanged before the check is agreed
+FrameCheck checkFor(LinkConnection* conn, unsigned char c) {
+    return c == C_SET || c == C_UA ? CheckXor : conn->frameCheck;
+}
+
+// Only the data of extended I-frames carries FEC parity
+int fecFor(LinkConnection* conn, unsigned char c) {
+    return c == C_IX || c == C_IXA ? conn->fecParity : 0;
+}
+
+int headerSize(unsigned char c) {
+    return hasAck(c) ? 5 : hasSeq(c) ? 4 : 3;
+}
+
+// BCC1 is the XOR of the header bytes before it
+int headerOk(const unsigned char* buf) {
+    if (buf[0] != A_TR && buf[0] != A_REC) return FALSE;
+    int size = headerSize(buf[1]);
+    unsigned char bcc1 = 0;
+    for (int i = 0; i < size - 1; i++) bcc1 ^= buf[i];
+    return buf[size - 1] == bcc1;
+}
+
+// Writes FLAG and the stuffed A C [Ns [Nr]] BCC1 into "out". Returns its size.
+int encodeHead(unsigned char a, unsigned char c, unsigned char n, unsigned char nr, unsigned char* out) {
+    unsigned char header[MAX_HEADER_SIZE];
+    int size = 0;
+    header[size++] = a;
+    header[size++] = c;
+    if (hasSeq(c)) header[size++] = n;
+    else n = 0;
+    if (hasAck(c)) header[size++] = nr;
+    else nr = 0;
+    header[size++] = a ^ c ^ n ^ nr;
+    out[0] = FLAG;
+    return 1 + stuffBytes(header, size, out + 1);
+}
+
+// Writes the stuffed check of the data (if any), the FEC parity of both and the closing FLAG
+// into "out". Returns its size.
+int encodeTail(FrameCheck check, int parity, const unsigned char* data, int dataSize, unsigned char* out) {
+    int size = 0;
+    if (dataSize > 0) {
+        unsigned char value[MAX_FRAME_CHECK_SIZE];
+        int checkSize = frameCheckSize(check);
+        frameCheckCompute(check, data, dataSize, value);
+        size = stuffBytes(value, checkSize, out);
+        if (parity > 0) {
+            unsigned char fec[FEC_PARITY_SIZE(MAX_LARGE_PAYLOAD_SIZE + MAX_FRAME_CHECK_SIZE, MAX_FEC_PARITY)];
+            size += stuffBytes(fec, fecEncode(data, dataSize, value, checkSize, parity, fec), out + size);
+        }
+    }
+    out[size++] = FLAG;
+    return size;
+}
+
+// Encodes an I-frame, stuffing the data once, straight from the caller's buffer.
+void encodeFrame(LinkConnection* conn, EncodedFrame* frame, unsigned char a, unsigned char c, unsigned char n, const unsigned char* data, int dataSize) {
+    frame->iov[0].iov_base = frame->head;
+    frame->iov[0].iov_len = encodeHead(a, c, n, conn->tramaRc, frame->head);
+    frame->iov[1].iov_base = frame->body;
+    frame->iov[1].iov_len = stuffBytes(data, dataSize, frame->body);
+    conn->stuffingBytes += frame->iov[1].iov_len - dataSize;
+    frame->iov[2].iov_base = frame->tail;
+    frame->iov[2].iov_len = encodeTail(checkFor(conn, c), fecFor(conn, c), data, dataSize, frame->tail);
+    frame->size = frame->iov[0].iov_len + frame->iov[1].iov_len + frame->iov[2].iov_len;
+}
+
+int sendEncoded(int fd, EncodedFrame* frame) {
+    return writev(fd, frame->iov, 3);
+}
+
+// Builds a small frame (supervision, SET / UA with parameters) into "out".
+// Returns the size of the stuffed frame.
+int buildFrame(LinkConnection* conn, unsigned char a, unsigned char c, unsigned char n, const unsigned char* data, int dataSize, unsigned char* out) {
+    int size = encodeHead(a, c, n, 0, out);
+    size += stuffBytes(data, dataSize, out + size);
+    size += encodeTail(checkFor(conn, c), 0, data, dataSize, out + size);
+    return size;
+}
+
+int sendSupSeq(LinkConnection* conn, unsigned char a, unsigned char c, unsigned char n) {
+    unsigned char buf[MAX_CONTROL_FRAME];
+    int size = buildFrame(conn, a, c, n, NULL, 0, buf);
+    return write(conn->fd, buf, size);
+}
+
+// Fills "frame" from the frame received so far, once its closing flag arrived.
+// Returns TRUE if it is a complete frame with a valid header.
+int parseFrame(LinkConnection* conn, Frame* frame) {
+    if (conn->rxPos < 3 || conn->rxEscaped || conn->rxPos < headerSize(conn->rxFrame[1])) return FALSE;
+
+    int header = headerSize(conn->rxFrame[1]);
+    frame->a = conn->rxFrame[0];
+    frame->c = conn->rxFrame[1];
+    frame->n = hasSeq(frame->c) ? conn->rxFrame[2] : 0;
+    frame->nr = hasAck(frame->c) ? conn->rxFrame[3] : 0;
+    frame->data = conn->rxFrame + header;
+    frame->dataSize = conn->rxPos - header;
+    frame->bcc2Ok = TRUE;
+    if (frame->dataSize > 0) {
+        FrameCheck check = checkFor(conn, frame->c);
+        int parity = fecFor(conn, frame->c);
+        int corrected = 0;
+        // repair the data and check first, the check then tells if the repair was right
+        if (parity > 0 && (frame->dataSize = fecDecode(frame->data, frame->dataSize, parity, &corrected)) < 0) frame->dataSize = 0;
+        frame->dataSize -= frameCheckSize(check);
+        if (frame->dataSize <= 0) {
+            frame->dataSize = 0;
+            frame->bcc2Ok = FALSE;
+        }
+        // the header XORs to zero, so conn->rxCheck is data ^ BCC2
+        else if (check == CheckXor && parity == 0) frame->bcc2Ok = conn->rxCheck == 0;
+        else {
+            unsigned char expected[MAX_FRAME_CHECK_SIZE];
+            frameCheckCompute(check, frame->data, frame->dataSize, expected);
+            frame->bcc2Ok = memcmp(expected, frame->data + frame->dataSize, frameCheckSize(check)) == 0;
+        }
+        if (corrected > 0 && frame->bcc2Ok) conn->fecRepaired++;
+    }
+    return TRUE;
+}
+
+// Consumes the bytes available in the serial port until a complete frame is found.
+// Returns TRUE when "frame" was filled, FALSE if no complete frame is available yet.
+int receiveFrame(LinkConnection* conn, Frame* frame) {
+    while (TRUE) {
+        if (conn->rxHead == conn->rxTail) {
+            int bytes = read(conn->fd, conn->rxRing, RX_RING_SIZE);
+            if (bytes <= 0) return FALSE;
+            conn->rxHead = 0;
+            conn->rxTail = bytes;
+        }
+        if (!conn->rxInFrame) { // hunting for a flag
+            unsigned char* flag = memchr(conn->rxRing + conn->rxHead, FLAG, conn->rxTail - conn->rxHead);
+            if (flag == NULL) {
+                conn->rxHead = conn->rxTail;
+                continue;
+            }
+            conn->rxHead = flag - conn->rxRing;
+        }
+
+        unsigned char byte = conn->rxRing[conn->rxHead++];
+        if (byte == FLAG) {
+            int complete = conn->rxInFrame && parseFrame(conn, frame);
+            // a closing flag may also open the next frame
+            conn->rxInFrame = TRUE;
+            conn->rxPos = 0;
+            conn->rxEscaped = FALSE;
+            conn->rxCheck = 0;
+            if (complete) return TRUE;
+            continue;
+        }
+        if (!conn->rxInFrame) continue;
+
+        if (byte == ESC) {
+            conn->rxEscaped = TRUE;
+            continue;
+        }
+        if (conn->rxEscaped) {
+            byte ^= 0x20;
+            conn->rxEscaped = FALSE;
+        }
+        if (conn->rxPos == FRAME_BODY_SIZE(conn->bufferPayload, conn->local.fecParity)) { // too long, wait for the next flag
+            conn->rxInFrame = FALSE;
+            continue;
+        }
+        conn->rxFrame[conn->rxPos++] = byte;
+        conn->rxCheck ^= byte;
+
+        // drop the frame as soon as a bad header is seen
+        if (conn->rxPos >= 3 && conn->rxPos == headerSize(conn->rxFrame[1]) && !headerOk(conn->rxFrame)) conn->rxInFrame = FALSE;
+    }
 }
 
-int stuffing(unsigned char* buf, unsigned char* new_buf, int n) {
-    int index = 1;
-    new_buf[0] = buf[0];
-    for (int i = 1; i < n; i++) {
-        if (buf[i] == FLAG) {
-            new_buf[index] = ESC;
-            index++;
-            new_buf[index] = 0x5E;
+// Sleeps until a frame arrives or the retransmission timer expires.
+// The lock is released while sleeping; the timer may be armed again meanwhile.
+// Once open, a silent line ends the wait with an error after IDLE_TIMEOUTS timeouts,
+// so a receiver whose peer died returns from llread instead of blocking forever.
+// Returns 1 when "frame" was filled, 0 on timeout or -1 on error.
+int waitFrame(LinkConnection* conn, Frame* frame) {
+    double idleSince = nowMs();
+    while (TRUE) {
+        if (receiveFrame(conn, frame)) return 1;
+
+        int idleMs = -1;
+        if (conn->openedAt > 0 && !conn->timerArmed) {
+            idleMs = (int)(idleSince + IDLE_TIMEOUTS * conn->timeoutMs - nowMs());
+            if (idleMs < 0) idleMs = 0;
+        }
+        struct pollfd fds[3] = {{conn->fd, POLLIN, 0}, {conn->timerFd, POLLIN, 0}, {conn->wakeFd, POLLIN, 0}};
+        pthread_mutex_unlock(&conn->lock);
+        int ready = poll(fds, 3, idleMs);
+        pthread_mutex_lock(&conn->lock);
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            return -1;
+        }
+        if (ready == 0 && conn->openedAt > 0 && !conn->timerArmed) {
+            printf("Nothing from the peer for %d ms\n", IDLE_TIMEOUTS * conn->timeoutMs);
+            return -1;
         }
-        else if (buf[i] == ESC) {
-            new_buf[index] = ESC;
-            index++;
-            new_buf[index] = 0x5D;
+        if (fds[0].revents & POLLIN) {
+            if (receiveFrame(conn, frame)) return 1;
+            idleSince = nowMs(); // part of a frame, the peer is there
         }
-        else new_buf[index] = buf[i];
+        if (fds[0].revents & (POLLERR | POLLHUP | POLLNVAL)) return -1;
+
+        uint64_t expirations;
+        if ((fds[2].revents & POLLIN) && read(conn->wakeFd, &expirations, sizeof(expirations)) > 0 && conn->failed) return -1;
+        // nothing to read if the timer was set again after it expired
+        if ((fds[1].revents & POLLIN) && read(conn->timerFd, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+            conn->timerArmed = FALSE;
+            conn->timeouts++;
+            // backoff steps below the configured timeout are not counted as failures
+            if (backedOffRto(conn) >= conn->timeoutMs) conn->timeoutCount++;
+            conn->backoff++;
+            return 0;
+        }
+    }
+}
+
+void setMode(LinkConnection* conn, const LinkParams* params, int extended) {
+    conn->arqMode = params->arqMode;
+    conn->windowSize = params->windowSize;
+    conn->frameCheck = params->frameCheck;
+    conn->fullDuplex = extended && params->fullDuplex;
+    conn->maxPayload = params->maxPayload;
+    conn->fecParity = extended ? params->fecParity : 0;
+    conn->extendedFrames = extended;
+    conn->seqMod = extended ? SEQ_MOD_EXT : 2;
+    if (extended) {
+        printf("Negotiated ARQ mode %d with window %d, frame check %d, frames up to %d bytes%s", conn->arqMode,
+               conn->windowSize, conn->frameCheck, conn->maxPayload, conn->fullDuplex ? ", full duplex" : "");
+        if (conn->fecParity > 0) printf(", FEC with %d parity bytes per block", conn->fecParity);
+        printf("\n");
+    }
+}
+
+int buildParams(const LinkParams* params, unsigned char* out) {
+    int pos = 0;
+    out[pos++] = PARAM_ARQ;
+    out[pos++] = 1;
+    out[pos++] = params->arqMode;
+    out[pos++] = PARAM_WINDOW;
+    out[pos++] = 1;
+    out[pos++] = params->windowSize;
+    out[pos++] = PARAM_CHECK;
+    out[pos++] = 1;
+    out[pos++] = params->frameCheck;
+    out[pos++] = PARAM_DUPLEX;
+    out[pos++] = 1;
+    out[pos++] = params->fullDuplex;
+    out[pos++] = PARAM_FRAME;
+    out[pos++] = 2;
+    out[pos++] = params->maxPayload >> 8;
+    out[pos++] = params->maxPayload & 0xFF;
+    out[pos++] = PARAM_FEC;
+    out[pos++] = 1;
+    out[pos++] = params->fecParity;
+    return pos;
+}
+
+// Reads the parameters of an extended SET / UA. Values not present keep the legacy ones.
+void parseParams(const unsigned char* in, int size, LinkParams* params) {
+    int pos = 0;
+    *params = legacyParams;
+    while (pos + 2 <= size && pos + 2 + in[pos + 1] <= size) {
+        unsigned char type = in[pos];
+        unsigned char length = in[pos + 1];
+        const unsigned char* value = in + pos + 2;
+        if (type == PARAM_ARQ && length == 1) params->arqMode = value[0];
+        else if (type == PARAM_WINDOW && length == 1) params->windowSize = value[0];
+        else if (type == PARAM_CHECK && length == 1) params->frameCheck = value[0];
+        else if (type == PARAM_DUPLEX && length == 1) params->fullDuplex = value[0];
+        else if (type == PARAM_FRAME && length == 2) params->maxPayload = value[0] << 8 | value[1];
+        else if (type == PARAM_FEC && length == 1) params->fecParity = value[0];
+        pos += 2 + length;
+    }
+}
+
+// Restricts the peer's values to what this end supports.
+void limitParams(LinkConnection* conn, LinkParams* params) {
+    if (params->arqMode > conn->local.arqMode) params->arqMode = conn->local.arqMode;
+    if (params->windowSize > conn->local.windowSize) params->windowSize = conn->local.windowSize;
+    if (params->windowSize < 1 || params->arqMode == ArqStopAndWait) params->windowSize = 1;
+    if (params->frameCheck > conn->local.frameCheck) params->frameCheck = conn->local.frameCheck;
+    params->fullDuplex = params->fullDuplex && conn->local.fullDuplex;
+    if (params->maxPayload > conn->local.maxPayload) params->maxPayload = conn->local.maxPayload;
+    if (params->maxPayload < 1) params->maxPayload = MAX_FRAME_PAYLOAD;
+    if (params->fecParity > conn->local.fecParity) params->fecParity = conn->local.fecParity;
+}
+
+// Applies the SET received by the receiver and answers with the matching UA.
+void acceptSet(LinkConnection* conn, Frame* frame) {
+    if (frame->dataSize == 0) {
+        setMode(conn, &legacyParams, FALSE);
+        sendSup(conn->fd, A_TR, C_UA);
+        return;
+    }
+
+    LinkParams params;
+    parseParams(frame->data, frame->dataSize, &params);
+    limitParams(conn, &params);
+    setMode(conn, &params, TRUE);
+
+    unsigned char out[MAX_PARAMS_SIZE];
+    unsigned char ua_buf[MAX_CONTROL_FRAME];
+    int size = buildFrame(conn, A_TR, C_UA, 0, out, buildParams(&params, out), ua_buf);
+    write(conn->fd, ua_buf, size);
+}
+
+unsigned char iControl(LinkConnection* conn, int ns) {
+    if (conn->fullDuplex) return C_IXA;
+    return conn->extendedFrames ? C_IX : FRAME_CONTROL(ns);
+}
+
+int isIFrame(LinkConnection* conn, Frame* frame) {
+    if (conn->extendedFrames) return frame->c == C_IX || frame->c == C_IXA;
+    return frame->c == FRAME_CONTROL(0) || frame->c == FRAME_CONTROL(1);
+}
+
+int frameNs(LinkConnection* conn, Frame* frame) {
+    return conn->extendedFrames ? frame->n : frame->c >> 6;
+}
+
+void sendAck(LinkConnection* conn, AckKind kind, int nr) {
+    unsigned char a = kind == AckRR ? A_TR : A_REC;
+    if (conn->extendedFrames) sendSupSeq(conn, a, kind == AckRR ? C_RRX : kind == AckREJ ? C_REJX : C_SREJX, nr);
+    else sendSup(conn->fd, a, kind == AckRR ? RR(nr) : REJECT(nr));
+    if (kind != AckSREJ) conn->ackPending = FALSE;
+    if (kind != AckRR) conn->rejectsSent++;
+}
+
+// Returns TRUE if the frame is an RR / REJ / SREJ, filling its kind and Nr.
+int parseAck(LinkConnection* conn, Frame* frame, int* nr, AckKind* kind) {
+    if (frame->dataSize != 0 || !frame->bcc2Ok) return FALSE;
+    if (conn->extendedFrames) {
+        if (frame->c == C_RRX) *kind = AckRR;
+        else if (frame->c == C_REJX) *kind = AckREJ;
+        else if (frame->c == C_SREJX) *kind = AckSREJ;
+        else return FALSE;
+        *nr = frame->n;
+        return TRUE;
+    }
+    if ((frame->c & 0x7F) != 0x05 && (frame->c & 0x7F) != 0x01) return FALSE;
+    *nr = frame->c >> 7;
+    *kind = (frame->c & 0x7F) == 0x01 ? AckREJ : AckRR;
+    return TRUE;
+}
+
+TxSlot* txSlot(LinkConnection* conn, int seq) {
+    return &conn->txWindow[seq % conn->seqMod % MAX_WINDOW_SIZE];
+}
+
+// Sends a frame of the window. Full duplex frames get the header again, so they carry
+// the current Nr and no separate RR is needed.
+void sendSlot(LinkConnection* conn, TxSlot* slot) {
+    if (hasAck(slot->c)) {
+        EncodedFrame* frame = &slot->frame;
+        frame->size -= frame->iov[0].iov_len;
+        frame->iov[0].iov_len = encodeHead(slot->a, slot->c, slot->n, conn->tramaRc, frame->head);
+        frame->size += frame->iov[0].iov_len;
+        conn->ackPending = FALSE;
+    }
+    sendEncoded(conn->fd, &slot->frame);
+    conn->lineBytesSent += slot->frame.size;
+    slot->sentAt = nowMs();
+    slot->queuedBytes = outputQueued(conn);
+}
 
-        index++;
+// Arms the retransmission timer for the oldest unacknowledged frame: its RTO counts from
+// when the line finished sending it, or from now if that is later. Every ack restarts it, so
+// frames written at once are each waited for behind the ones before them, not from their write.
+void startWindowTimer(LinkConnection* conn) {
+    TxSlot* slot = txSlot(conn, conn->txBase);
+    double now = nowMs();
+    double sent = slot->sentAt + txTimeMs(conn, slot->queuedBytes);
+    int ms = (int)((sent > now ? sent : now) + backedOffRto(conn) - now);
+    setTimer(conn, ms > 1 ? ms : 1);
+}
+
+// Go back to conn->txBase and send every unacknowledged frame again.
+void resendWindow(LinkConnection* conn) {
+    for (int i = 0; i < conn->txCount; i++) {
+        TxSlot* slot = txSlot(conn, conn->txBase + i);
+        sendSlot(conn, slot);
+        slot->retransmitted = TRUE;
+        conn->retransmissions++;
     }
-    new_buf[index] = buf[n];
-    return index;
+    startWindowTimer(conn);
 }
 
-int destuffing(unsigned char* buf, unsigned char* destuf_buf, int n) {
-    int index = 0;
-    int final_lenght = 1;
+// Selective repeat timeout: only the oldest frame is sent again. The receiver asks for
+// the others it is missing with SREJ, so resending the whole window would mostly duplicate.
+void resendOldest(LinkConnection* conn) {
+    TxSlot* slot = txSlot(conn, conn->txBase);
+    sendSlot(conn, slot);
+    slot->retransmitted = TRUE;
+    conn->retransmissions++;
+    startWindowTimer(conn);
+}
 
-    for (int i = 0; i < n; i++) { // usar o n
-        if (buf[i] == ESC && buf[i + 1] == 0x5E) {
-            destuf_buf[index] = FLAG;
-            i++;
+void handleAck(LinkConnection* conn, int nr, AckKind kind) {
+    int acked = (nr - conn->txBase + conn->seqMod) % conn->seqMod;
+
+    if (kind != AckRR) conn->rejReceived++;
+    if (kind == AckSREJ) { // only the frame Nr was lost
+        if (acked < conn->txCount) {
+            TxSlot* slot = txSlot(conn, nr);
+            printf("Resending frame %d\n", nr);
+            sendSlot(conn, slot);
+            slot->retransmitted = TRUE;
+            conn->retransmissions++;
+            if (acked == 0) startWindowTimer(conn);
         }
-        else if (buf[i] == ESC && buf[i + 1] == 0x5D) {
-            destuf_buf[index] = ESC;
-            i++;
+        return;
+    }
+    if (acked > conn->txCount) return; // outside the window
+
+    if (acked > 0) {
+        // Karn: no sample if any frame the ack covers was sent again. The frames after a gap
+        // are only acknowledged once its retransmission arrives, so their ack is late.
+        int retransmitted = FALSE;
+        for (int i = 0; i < acked; i++) retransmitted |= txSlot(conn, conn->txBase + i)->retransmitted;
+        TxSlot* last = txSlot(conn, nr - 1 + conn->seqMod);
+        if (!retransmitted) {
+            double ms = nowMs() - last->sentAt;
+            conn->ackLatency[latencyBucket(ms)]++;
+            rttSample(conn, ms - txTimeMs(conn, last->queuedBytes));
         }
-        else destuf_buf[index] = buf[i];
+        conn->timeoutCount = 0;
+    }
+    conn->txBase = nr;
+    conn->txCount -= acked;
+
+    if (kind == AckREJ && conn->txCount > 0) {
+        printf("Trying again\n");
+        resendWindow(conn);
+    }
+    else if (acked > 0) {
+        if (conn->txCount > 0) startWindowTimer(conn);
+        else stopTimer(conn);
+    }
+}
+
+// Takes the frame expected next. It goes straight to "packet" when an llread is waiting
+// for it and nothing was queued before, otherwise to the queue read by the next llread.
+// The acknowledgement is sent later, on the next I-frame or before waiting on the port.
+// Returns the size copied to "packet", 0 if queued or -1 if the queue is full.
+int acceptData(LinkConnection* conn, const unsigned char* data, int size, unsigned char* packet) {
+    int delivered = 0;
+    if (packet != NULL && conn->rxQueueCount == 0) {
+        memcpy(packet, data, size);
+        delivered = size;
+    }
+    else {
+        if (conn->rxQueueCount == MAX_WINDOW_SIZE) return -1; // the peer sends it again
+        RxSlot* slot = &conn->rxQueue[(conn->rxQueueHead + conn->rxQueueCount) % MAX_WINDOW_SIZE];
+        memcpy(slot->data, data, size);
+        slot->size = size;
+        conn->rxQueueCount++;
+    }
+    conn->tramaRc = (conn->tramaRc + 1) % conn->seqMod;
+    conn->rejSent = FALSE;
+    conn->ackPending = TRUE;
+    conn->framesReceived++;
+    return delivered;
+}
+
+// Selective repeat: asks for frame "seq" with SREJ.
+void requestFrame(LinkConnection* conn, int seq) {
+    RxSlot* slot = &conn->rxWindow[seq % MAX_WINDOW_SIZE];
+    sendAck(conn, AckSREJ, seq);
+    slot->srejSent = TRUE;
+    slot->srejOrder = ++conn->srejCount;
+}
+
+// Selective repeat: asks for every frame missing before "ns" that was not asked for yet.
+void requestMissing(LinkConnection* conn, int ns) {
+    for (int seq = conn->tramaRc; seq != ns; seq = (seq + 1) % conn->seqMod) {
+        RxSlot* slot = &conn->rxWindow[seq % MAX_WINDOW_SIZE];
+        if (!slot->present && !slot->srejSent) requestFrame(conn, seq);
+    }
+}
 
-        index++;
-        final_lenght++;
+// Selective repeat: the frame asked for by SREJ number "order" arrived. The sender answers
+// SREJs in order and the line keeps it, so the frames asked for before it that are still
+// missing were lost again, and are asked for again.
+void requestLost(LinkConnection* conn, int order) {
+    for (int i = 0; i < conn->windowSize; i++) {
+        int seq = (conn->tramaRc + i) % conn->seqMod;
+        RxSlot* slot = &conn->rxWindow[seq % MAX_WINDOW_SIZE];
+        if (!slot->present && slot->srejSent && slot->srejOrder < order) requestFrame(conn, seq);
     }
-    final_lenght--;
-    return final_lenght;
+}
+
+// Returns the size copied to "packet" (see acceptData), or 0.
+int handleIFrame(LinkConnection* conn, Frame* frame, unsigned char* packet) {
+    if (hasAck(frame->c) && frame->bcc2Ok) handleAck(conn, frame->nr, AckRR);
+
+    int ns = frameNs(conn, frame);
+    int ahead = (ns - conn->tramaRc + conn->seqMod) % conn->seqMod;
+
+    if (conn->arqMode == ArqSelectiveRepeat) {
+        if (ahead >= conn->windowSize) { // duplicate
+            conn->ackPending = TRUE;
+            conn->duplicates++;
+            return 0;
+        }
+        RxSlot* slot = &conn->rxWindow[ns % MAX_WINDOW_SIZE];
+        if (!frame->bcc2Ok) {
+            // a damaged copy of a frame already asked for means that retransmission was lost too
+            if (!slot->present) {
+                printf("Packet reject. Retransmiting\n");
+                requestFrame(conn, ns);
+            }
+            return 0;
+        }
+        int order = slot->srejSent && !slot->present ? slot->srejOrder : 0;
+        if (ahead == 0) {
+            int delivered = acceptData(conn, frame->data, frame->dataSize, packet);
+            if (delivered < 0) return 0;
+            slot->srejSent = FALSE;
+            // the frames kept after it follow in order
+            while ((slot = &conn->rxWindow[conn->tramaRc % MAX_WINDOW_SIZE])->present) {
+                if (acceptData(conn, slot->data, slot->size, NULL) < 0) break;
+                slot->present = FALSE;
+                slot->srejSent = FALSE;
+            }
+            if (order > 0) requestLost(conn, order);
+            return delivered;
+        }
+        if (!slot->present) { // keep it until the gap before it is filled
+            memcpy(slot->data, frame->data, frame->dataSize);
+            slot->size = frame->dataSize;
+            slot->present = TRUE;
+            slot->srejSent = FALSE;
+        }
+        else conn->duplicates++;
+        if (order > 0) requestLost(conn, order);
+        requestMissing(conn, ns);
+        return 0;
+    }
+
+    if (!frame->bcc2Ok) {
+        if (ahead == 0 && (!conn->rejSent || conn->windowSize == 1)) {
+            printf("Packet reject. Retransmiting\n");
+            sendAck(conn, AckREJ, conn->tramaRc); // send reject
+            conn->rejSent = TRUE;
+        }
+        return 0;
+    }
+
+    if (ahead != 0) {
+        if (ahead < conn->windowSize) { // a frame before this one was lost
+            if (!conn->rejSent) {
+                sendAck(conn, AckREJ, conn->tramaRc);
+                conn->rejSent = TRUE;
+            }
+        }
+        else { // duplicate
+            conn->ackPending = TRUE;
+            conn->duplicates++;
+        }
+        return 0;
+    }
+
+    int delivered = acceptData(conn, frame->data, frame->dataSize, packet);
+    return delivered > 0 ? delivered : 0;
+}
+
+// Acts on any frame received after llopen. Returns the size copied to "packet", or 0.
+int processFrame(LinkConnection* conn, Frame* frame, unsigned char* packet) {
+    int nr;
+    AckKind kind;
+
+    if (parseAck(conn, frame, &nr, &kind)) handleAck(conn, nr, kind);
+    else if (isIFrame(conn, frame)) return handleIFrame(conn, frame, packet);
+    else if (frame->c == C_SET) { // our UA was lost
+        if (frame->bcc2Ok) acceptSet(conn, frame);
+    }
+    else if (frame->c == C_DISC) {
+        if (frame->a == A_REC) conn->discReceived = TRUE; // answer to ours
+        // our own frames must be acknowledged first, the peer sends its DISC again
+        else if (conn->txCount == 0) {
+            sendSup(conn->fd, A_REC, C_DISC); // send disc
+            conn->discReceived = TRUE;
+        }
+    }
+    else if (frame->c == C_UA) conn->uaReceived = TRUE;
+    return 0;
+}
+
+// Marks the connection failed and wakes the call waiting on the port, if any.
+void failConnection(LinkConnection* conn) {
+    uint64_t one = 1;
+    conn->failed = TRUE;
+    write(conn->wakeFd, &one, sizeof(one));
+    pthread_cond_broadcast(&conn->changed);
+}
+
+// Waits for the next frame or timeout and processes it. Only one call waits on the port
+// at a time; the others sleep until it has processed something.
+// Unacknowledged frames are sent again on timeout, whichever call is waiting.
+// Returns 1 after a frame, 0 on timeout or -1 on error. "delivered" gets the size of
+// the data copied to "packet", if any.
+int pump(LinkConnection* conn, unsigned char* packet, int* delivered) {
+    Frame frame;
+    int result;
+
+    *delivered = 0;
+    if (conn->pumping) {
+        pthread_cond_wait(&conn->changed, &conn->lock);
+        return 1;
+    }
+    conn->pumping = TRUE;
+
+    if (receiveFrame(conn, &frame)) result = 1;
+    else {
+        // nothing more to process, the frames accepted so far are acknowledged before sleeping
+        if (conn->ackPending) sendAck(conn, AckRR, conn->tramaRc); // send rr
+        result = waitFrame(conn, &frame);
+    }
+
+    if (result > 0) *delivered = processFrame(conn, &frame, packet);
+    else if (result < 0) conn->failed = TRUE;
+    else if (conn->txCount > 0 && !conn->writeFailed) {
+        // the frames are given up, but the peer may still be sending: only llwrite fails
+        if (conn->timeoutCount >= conn->nRetransmissions) {
+            conn->writeFailed = TRUE;
+            stopTimer(conn);
+        }
+        else if (conn->arqMode == ArqSelectiveRepeat) resendOldest(conn);
+        else resendWindow(conn);
+    }
+
+    conn->pumping = FALSE;
+    pthread_cond_broadcast(&conn->changed);
+    return result;
+}
+
+// Processes the frames already received, without waiting.
+void drainFrames(LinkConnection* conn) {
+    Frame frame;
+    if (conn->pumping) return;
+    while (receiveFrame(conn, &frame)) processFrame(conn, &frame, NULL);
+    pthread_cond_broadcast(&conn->changed);
+}
+
+// Processes frames until at most "maxOutstanding" frames are unacknowledged.
+// Returns 1 on success or -1 if retransmissions were exhausted.
+int waitAcks(LinkConnection* conn, int maxOutstanding) {
+    int delivered;
+
+    drainFrames(conn);
+    while (conn->txCount > maxOutstanding) {
+        if (conn->failed || conn->writeFailed || conn->discReceived) return -1;
+        pump(conn, NULL, &delivered);
+    }
+    return conn->failed || conn->writeFailed ? -1 : 1;
 }
 
 int connect(const char* serialPort, int baudRate) {
@@ -145,418 +1023,402 @@ int connect(const char* serialPort, int baudRate) {
     return fd;
 }
 
+// Releases everything held by the connection, called with its lock held.
+// Returns the result of closing the port.
+int freeConnection(LinkConnection* conn) {
+    int result = 0;
+    if (conn->timerFd >= 0) close(conn->timerFd);
+    if (conn->wakeFd >= 0) close(conn->wakeFd);
+    if (conn->fd >= 0) result = close(conn->fd);
+    free(conn->buffers);
+    pthread_mutex_unlock(&conn->lock);
+    pthread_mutex_destroy(&conn->lock);
+    pthread_cond_destroy(&conn->changed);
+    free(conn);
+    return result;
+}
 
-    struct timeval start_prop_time, end_prop_time;
+// Allocates the frame buffers for payloads of up to "payload" bytes: the frame being
+// received, the receive queue and window, and the encoded frames of the transmit window.
+int allocBuffers(LinkConnection* conn, int payload) {
+    int rxSize = FRAME_BODY_SIZE(payload, conn->local.fecParity);
+    int slotSize = payload;
+    int bodySize = STUFFED_MAX_SIZE(payload);
+    int tailSize = STUFFED_MAX_SIZE(FRAME_TAIL_SIZE(payload, conn->local.fecParity)) + 1;
+    conn->buffers = malloc(rxSize + MAX_WINDOW_SIZE * (2 * slotSize + bodySize + tailSize));
+    if (conn->buffers == NULL) return -1;
+
+    unsigned char* next = conn->buffers;
+    conn->rxFrame = next;
+    next += rxSize;
+    for (int i = 0; i < MAX_WINDOW_SIZE; i++) {
+        conn->rxWindow[i].data = next;
+        conn->rxQueue[i].data = next + slotSize;
+        conn->txWindow[i].frame.body = next + 2 * slotSize;
+        conn->txWindow[i].frame.tail = next + 2 * slotSize + bodySize;
+        next += 2 * slotSize + bodySize + tailSize;
+    }
+    conn->bufferPayload = payload;
+    return 0;
+}
 
-    double elapsed_2prop_time;
+// fd based API: the connections are looked up by their serial port descriptor
+int registerConnection(LinkConnection* conn) {
+    int registered = FALSE;
+    pthread_mutex_lock(&fdConnectionsLock);
+    for (int i = 0; i < MAX_FD_CONNECTIONS && !registered; i++) {
+        if (fdConnections[i] == NULL) {
+            fdConnections[i] = conn;
+            registered = TRUE;
+        }
+    }
+    pthread_mutex_unlock(&fdConnectionsLock);
+    return registered;
+}
+
+LinkConnection* findConnection(int fd, int unregister) {
+    LinkConnection* conn = NULL;
+    pthread_mutex_lock(&fdConnectionsLock);
+    for (int i = 0; i < MAX_FD_CONNECTIONS; i++) {
+        if (fdConnections[i] != NULL && fdConnections[i]->fd == fd) {
+            conn = fdConnections[i];
+            if (unregister) fdConnections[i] = NULL;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&fdConnectionsLock);
+    return conn;
+}
 
 ////////////////////////////////////////////////
 // LLOPEN
 ////////////////////////////////////////////////
-int llopen(LinkLayer connectionParameters) {
-    int fd;
-    if((fd = connect(connectionParameters.serialPort, connectionParameters.baudRate)) < 0) {
+LinkConnection* llopenConnection(LinkLayer connectionParameters) {
+    LinkConnection* conn = calloc(1, sizeof(LinkConnection));
+    if (conn == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    conn->timerFd = -1;
+    conn->wakeFd = -1;
+    pthread_mutex_init(&conn->lock, NULL);
+    pthread_cond_init(&conn->changed, NULL);
+    pthread_mutex_lock(&conn->lock);
+    if((conn->fd = connect(connectionParameters.serialPort, connectionParameters.baudRate)) < 0) {
         perror("Connection error\n");
-        return -1;
+        freeConnection(conn);
+        return NULL;
     }
 
-    timeout = connectionParameters.timeout;
-    nRetransmissions = connectionParameters.nRetransmissions;
+    conn->role = connectionParameters.role;
+    conn->timeoutMs = connectionParameters.timeoutMs > 0 ? connectionParameters.timeoutMs : connectionParameters.timeout * 1000;
+    conn->nRetransmissions = connectionParameters.nRetransmissions;
+    conn->lineBps = lineBitsPerSecond(connectionParameters.baudRate);
+    conn->rtoMs = conn->timeoutMs;
+    conn->local.arqMode = connectionParameters.arqMode;
+    conn->local.windowSize = connectionParameters.windowSize;
+    conn->local.frameCheck = connectionParameters.frameCheck;
+    conn->local.fullDuplex = connectionParameters.fullDuplex;
+    conn->local.maxPayload = connectionParameters.maxFramePayload > 0 ? connectionParameters.maxFramePayload : MAX_FRAME_PAYLOAD;
+    if (conn->local.maxPayload > MAX_LARGE_PAYLOAD_SIZE) conn->local.maxPayload = MAX_LARGE_PAYLOAD_SIZE;
+    conn->local.fecParity = connectionParameters.fecParity;
+    if (conn->local.fecParity > MAX_FEC_PARITY) conn->local.fecParity = MAX_FEC_PARITY;
+    if (conn->local.fecParity < 0) conn->local.fecParity = 0;
+    if (conn->local.windowSize > MAX_WINDOW_SIZE) conn->local.windowSize = MAX_WINDOW_SIZE;
+    if (conn->local.windowSize < 1 || conn->local.arqMode == ArqStopAndWait) conn->local.windowSize = 1;
+    setMode(conn, &legacyParams, FALSE);
+    // peers that do not negotiate may send MAX_FRAME_PAYLOAD bytes whatever this end proposes
+    if (allocBuffers(conn, conn->local.maxPayload > MAX_FRAME_PAYLOAD ? conn->local.maxPayload : MAX_FRAME_PAYLOAD) < 0) {
+        perror("malloc");
+        freeConnection(conn);
+        return NULL;
+    }
+    if ((conn->timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0 ||
+        (conn->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        perror("timerfd_create");
+        freeConnection(conn);
+        return NULL;
+    }
+
+    Frame frame;
 
     switch (connectionParameters.role) {
 
         case LlTx: {
-            (void)signal(SIGALRM, alarmHandler);
-            unsigned char set_buf[5];
-            set_buf[0] = FLAG;
-            set_buf[1] = A_TR;
-            set_buf[2] = C_SET;
-            set_buf[3] = set_buf[1] ^ set_buf[2];
-            set_buf[4] = FLAG;
-            
-            gettimeofday(&start_prop_time, NULL);
-            sendFrame(fd, set_buf, 5); // send connection set
+            // the first half of the attempts propose the extended mode,
+            // the rest fall back to the plain SET understood by older receivers
+            unsigned char params[MAX_PARAMS_SIZE];
+            unsigned char set_ext[MAX_CONTROL_FRAME + 4];
+            unsigned char set_buf[5] = {FLAG, A_TR, C_SET, A_TR ^ C_SET, FLAG};
+            int extAttempts = conn->nRetransmissions / 2 > 0 ? conn->nRetransmissions / 2 : 1;
+            int set_ext_size = buildFrame(conn, A_TR, C_SET, 0, params, buildParams(&conn->local, params), set_ext);
+            // older receivers read 5 bytes at a time and only find a plain SET that starts
+            // a read, so the extended one is filled with idle flags to a multiple of 5
+            while (set_ext_size % 5 != 0) set_ext[set_ext_size++] = FLAG;
+            struct timeval start_prop_time, end_prop_time;
 
-            unsigned char received_ua_buf[5];
-
-            while (STOP == FALSE && alarmCount < nRetransmissions) {
-                // Returns after 5 chars have been inputted
-                int bytes = read(fd, received_ua_buf, 5); // receive connection ua
-                gettimeofday(&end_prop_time, NULL);
-
-                if (bytes && received_ua_buf[0] == FLAG && received_ua_buf[1] == A_TR
-                && received_ua_buf[2] == C_UA && received_ua_buf[3] == (received_ua_buf[1] ^ received_ua_buf[2])
-                && received_ua_buf[4] == FLAG) {
-                    
-                    alarm(0);
-                    STOP = TRUE;
-                }
-                else {
-                    if (alarmEnabled == FALSE) {
-                        sendFrame(fd, set_buf, 5);
-                        alarmEnabled = TRUE;
+            gettimeofday(&start_prop_time, NULL);
+            sendFrame(conn, set_ext, set_ext_size); // send connection set
+
+            while (TRUE) {
+                int result = waitFrame(conn, &frame);
+                if (result > 0) {
+                    if (frame.c != C_UA || !frame.bcc2Ok) continue;
+                    gettimeofday(&end_prop_time, NULL);
+                    stopTimer(conn);
+                    // seed the estimator, unless the SET had to be repeated (Karn)
+                    if (conn->timeoutCount == 0) {
+                        double elapsed = (end_prop_time.tv_sec - start_prop_time.tv_sec) * 1000.0 +
+                                         (end_prop_time.tv_usec - start_prop_time.tv_usec) / 1000.0;
+                        rttSample(conn, elapsed);
                     }
+                    if (frame.dataSize > 0) {
+                        LinkParams params;
+                        parseParams(frame.data, frame.dataSize, &params);
+                        limitParams(conn, &params);
+                        setMode(conn, &params, TRUE);
+                    }
+                    break;
+                }
+                if (result < 0 || conn->timeoutCount >= conn->nRetransmissions) {
+                    printf("No answer to SET\n");
+                    freeConnection(conn);
+                    return NULL;
                 }
+                if (conn->timeoutCount < extAttempts) sendFrame(conn, set_ext, set_ext_size);
+                else sendFrame(conn, set_buf, 5);
             }
+            conn->timeoutCount = 0;
 
-
-            elapsed_2prop_time= (end_prop_time.tv_sec - start_prop_time.tv_sec) + 
+            conn->elapsed_2prop_time= (end_prop_time.tv_sec - start_prop_time.tv_sec) +
                    (end_prop_time.tv_usec - start_prop_time.tv_usec) / 1e6;
-            printf("Prop time * 2: %f seconds\n", elapsed_2prop_time);
-            
-            return fd;
+            printf("Prop time * 2: %f seconds\n", conn->elapsed_2prop_time);
+            break;
         }
 
         case LlRx: {
-            unsigned char received_buf[5];
-
-            enum States currentState = START;
-            sleep(4);
-
-            while (STOP == FALSE) { //
-                // Returns after 5 chars have been input
-                int bytes = read(fd, received_buf, 5);
-
-                int startOver = 0;
-                int stop = 0;
-
-                for (int i = 0; i < bytes && !startOver && !stop; i++) {
-                    switch (currentState) {
-                        case START:
-                            if (received_buf[i] == FLAG) currentState = FLAG_RCV;
-                            else startOver = 1;
-                            break;
-
-                        case FLAG_RCV:
-                            if (received_buf[i] == A_TR) currentState = A_RCV;
-                            else if (received_buf[i] == FLAG) startOver = 1;
-                            else {
-                                currentState = START;
-                                startOver = 1;
-                            }
-                            break;
-
-                        case A_RCV:
-                            if (received_buf[i] == A_TR) currentState = C_RCV;
-                            else if (received_buf[i] == FLAG) {
-                                startOver = 1;
-                                currentState = FLAG_RCV;
-                            }
-                            else {
-                                currentState = START;
-                                startOver = 1;
-                            }
-                            break;
-
-                        case C_RCV:
-                            if (received_buf[i] == (received_buf[1] ^ received_buf[2])) currentState = BCC_OK;
-                            else if (received_buf[i] == FLAG) {
-                                startOver = 1;
-                                currentState = FLAG_RCV;
-                            }
-                            else {
-                                currentState = START;
-                                startOver = 1;
-                            }
-                            break;
-
-                        case BCC_OK:
-                            if (received_buf[i] == FLAG) currentState = STOP_MACHINE;
-                            else {
-                                currentState = START;
-                                startOver = 1;
-                            }
-                            break;
-
-                        case STOP_MACHINE:
-                            stop = 1;
-                            STOP = TRUE;
-                            break;
-
-                        default:
-                            break;
-                    }
+            while (TRUE) {
+                int result = waitFrame(conn, &frame);
+                if (result < 0) {
+                    freeConnection(conn);
+                    return NULL;
                 }
+                if (frame.c == C_SET && frame.bcc2Ok) break;
             }
-
-            
-           
-        
-                
-            sendSup(fd, A_TR, C_UA); // send connection ua
+            acceptSet(conn, &frame); // send connection ua
             break;
         }
     }
-    
-    return fd;
+
+    conn->openedAt = nowMs();
+    pthread_mutex_unlock(&conn->lock);
+    return conn;
+}
+
+int llopen(LinkLayer connectionParameters) {
+    LinkConnection* conn = llopenConnection(connectionParameters);
+    if (conn == NULL) return -1;
+    if (!registerConnection(conn)) {
+        printf("Too many open connections\n");
+        pthread_mutex_lock(&conn->lock);
+        freeConnection(conn);
+        return -1;
+    }
+    return conn->fd;
 }
 
 ////////////////////////////////////////////////
 // LLWRITE
 ////////////////////////////////////////////////
-int llwrite(int fd, const unsigned char* payload, int payloadSize) {
-    unsigned char new_buf[2 * payloadSize];
-    unsigned char buf[payloadSize + 5];
-    buf[0] = FLAG;
-    buf[1] = A_TR;
-    buf[2] = FRAME_CONTROL(tramaTr);
-    buf[3] = buf[1] ^ buf[2];
-    long pos = 4;
-
-    // fill buffer with stuffed payload
-    for (int i = 0; i < payloadSize; i++) {
-        buf[pos] = payload[i];
-        pos++;
+int llwriteConnection(LinkConnection* conn, const unsigned char* payload, int payloadSize) {
+    double start = nowMs();
+    pthread_mutex_lock(&conn->lock);
+    if (payloadSize <= 0 || payloadSize > conn->maxPayload) {
+        pthread_mutex_unlock(&conn->lock);
+        return -1;
     }
-    // build the bcc2 with the payload
-    buf[pos] = buildBCC2(payload, payloadSize);
-    pos++;
-    buf[pos] = FLAG;
+    conn->users++;
+
+    // wait for a free slot in the window
+    int size = -1;
+    if (waitAcks(conn, conn->windowSize - 1) > 0) {
+        TxSlot* slot = txSlot(conn, conn->tramaTr);
+        slot->a = A_TR;
+        slot->c = iControl(conn, conn->tramaTr);
+        slot->n = conn->tramaTr;
+        encodeFrame(conn, &slot->frame, slot->a, slot->c, slot->n, payload, payloadSize);
+        // a frame that cannot carry the ack would hold it behind the whole window
+        if (conn->ackPending && !hasAck(slot->c)) sendAck(conn, AckRR, conn->tramaRc);
+        sendSlot(conn, slot);
+        size = slot->frame.size;
+        conn->tramaTr = (conn->tramaTr + 1) % conn->seqMod;
+        conn->txCount++;
+        conn->framesSent++;
+        conn->dataSent += payloadSize;
+        slot->retransmitted = FALSE;
+        if (conn->txCount == 1) startWindowTimer(conn);
+
+        // stop-and-wait returns only after the RR, windowed modes just drain pending acks
+        if (waitAcks(conn, conn->arqMode == ArqStopAndWait ? 0 : conn->windowSize) < 0) size = -1;
+    }
+    if (size < 0) printf("Retransmissions exceeded\n");
+    conn->writeLatency[latencyBucket(nowMs() - start)]++;
 
-    int new_buf_size = stuffing(buf, new_buf, pos);
-    sendFrame(fd, new_buf, new_buf_size + 1);
+    conn->users--;
+    pthread_cond_broadcast(&conn->changed);
+    pthread_mutex_unlock(&conn->lock);
+    return size;
+}
 
-    unsigned char ua_buf[5];
-    STOP = FALSE;
-    while (STOP == FALSE && alarmCount < nRetransmissions) {
-        int bytes = read(fd, ua_buf, 5);
+int llwrite(int fd, const unsigned char* payload, int payloadSize) {
+    LinkConnection* conn = findConnection(fd, FALSE);
+    return conn != NULL ? llwriteConnection(conn, payload, payloadSize) : -1;
+}
 
-        if (bytes && ua_buf[0] == FLAG && (ua_buf[1] == A_TR || ua_buf[1] == A_REC) && (ua_buf[2] == RR(0) || ua_buf[2] == RR(1)) && ua_buf[3] == (ua_buf[1] ^ ua_buf[2]) && ua_buf[4] == FLAG ) {
-            alarm(0);
-            tramaTr = (tramaTr + 1) % 2;
-            STOP = TRUE;
+////////////////////////////////////////////////
+// LLREAD
+////////////////////////////////////////////////
+int llreadConnection(LinkConnection* conn, unsigned char* packet) {
+    pthread_mutex_lock(&conn->lock);
+    conn->users++;
+
+    int size = 0;
+    while (TRUE) {
+        if (conn->rxQueueCount > 0) {
+            RxSlot* slot = &conn->rxQueue[conn->rxQueueHead];
+            memcpy(packet, slot->data, slot->size);
+            size = slot->size;
+            conn->rxQueueHead = (conn->rxQueueHead + 1) % MAX_WINDOW_SIZE;
+            conn->rxQueueCount--;
+            break;
         }
-
-        else if(bytes && ua_buf[0] == FLAG && (ua_buf[1] == A_TR || ua_buf[1] == A_REC) && (ua_buf[2] == REJECT(0) || ua_buf[2] == REJECT(1)) && ua_buf[3] == (ua_buf[1] ^ ua_buf[2]) && ua_buf[4] == FLAG ){
-            alarm(0);
-            printf("Trying again\n");
-            sendFrame(fd, new_buf, new_buf_size + 1);            
+        if (conn->discReceived) { // the link was closed
+            size = 0;
+            break;
         }
-
-        else {
-            if (alarmEnabled == FALSE) {
-                sendFrame(fd, new_buf, new_buf_size + 1);
-                alarmEnabled = TRUE;
-            }
+        if (conn->failed) {
+            size = -1;
+            break;
         }
+        pump(conn, packet, &size);
+        if (size > 0) break;
     }
+    if (size > 0) conn->dataReceived += size;
 
-    if(alarmCount >= nRetransmissions) {
-        perror("Alarm count exceeded\n");
-        llclose(fd, 0);
-        return -1;
-    }
+    conn->users--;
+    pthread_cond_broadcast(&conn->changed);
+    pthread_mutex_unlock(&conn->lock);
+    return size;
+}
 
-    return new_buf_size + 1;
+int llread(int fd, unsigned char* packet) {
+    LinkConnection* conn = findConnection(fd, FALSE);
+    return conn != NULL ? llreadConnection(conn, packet) : -1;
 }
 
 ////////////////////////////////////////////////
-// LLREAD
+// LLCLOSE
 ////////////////////////////////////////////////
-int llread(int fd, unsigned char* packet) {
-    unsigned char buf[1050];
-    unsigned char destuffed_payload[1000];
-    STOP = FALSE;
-    enum States currentState = START;
-    int i = 0;
-    int destuf_size;
-
-    while (STOP == FALSE) {
-        int startOver = 0;
-        int stop = 0;
-        unsigned char stuffed_payload[2100];
-        unsigned char byte;
-        int p = 0;
-        int read_success = 0;
-        int its_disc = 0;
-        int c_b;
-        while (!startOver && !stop) {
-            if (read(fd, &byte, 1) || read_success) {
-                
-                switch (currentState) {
-                    case START:
-                        if (byte == FLAG) {
-                            buf[i] = byte;
-                            i++;
-                            currentState = FLAG_RCV;
-                        }
-                        else {
-                            startOver = 1;
-                            i = 0;
-                        }
-                        break;
-
-                    case FLAG_RCV:  
-                        if (byte == A_TR) {
-                            buf[i] = byte;
-                            i++;
-                            currentState = A_RCV;
-                        }
-                        else if (byte == FLAG) {
-                            startOver = 1;
-                            i = 1;
-                            
-                        }
-                        else {
-                            currentState = START;
-                            startOver = 1;
-                            i = 0;
-                        }
-                        break;
-
-                    case A_RCV:
-                        if (byte == 0x00 || byte == 0x40) { // control package
-                            buf[i] = byte;
-                            c_b = byte;
-                            i++;
-                            currentState = CP_RCV;
-                        }
-                        else if (byte == C_SET) { // regular set
-                            c_b = byte;
-                            currentState = C_RCV;
-                        }
-                        else if (byte == C_DISC) { // disconnect
-                            c_b = byte;
-                            currentState = C_RCV;
-                            its_disc = 1;
-                        }
-                        else if (byte == FLAG) {
-                            startOver = 1;
-                            i = 0;
-                            currentState = FLAG_RCV;
-                        }
-                        else {
-                            currentState = START;
-                            startOver = 1;
-                            i = 0;
-                        }
-                        break;
-
-                    case C_RCV:
-                        if (byte == (buf[1] ^ c_b)) {  
-                            buf[i] = byte;
-                            i++;
-                            currentState = BCC1_OK;
-                            read_success = 1;
-                        }
-                        else if (byte == FLAG) {
-                            startOver = 1;
-                            i = 0;
-                            currentState = FLAG_RCV;
-                        }
-                        else {
-                            currentState = START;
-                            startOver = 1;
-                            i = 0;
-                        }
-                        break;
-
-                    case BCC1_OK:
-                        if (byte == FLAG) {
-                            if (its_disc) currentState = STOP_MACHINE_DISC;
-                            else currentState = STOP_MACHINE;
-                        }
-                        else {
-                            currentState = START;
-                            startOver = 1;
-                        }
-                        break;
-
-                    case CP_RCV:
-                        if (byte == (buf[1] ^ c_b)) {
-
-                            buf[i] = byte;
-                            i++;
-                            currentState = PAYLOAD;
-                        }
-                        else if (byte == FLAG) {
-                            startOver = 1;
-                            i = 0;
-                            currentState = FLAG_RCV;
-                        }
-                        else {
-                            currentState = START;
-                            startOver = 1;
-                            i = 0;
-                        }
-                        break;
-
-                    case PAYLOAD:
-                        if (byte == FLAG) {
-                            buf[i] = byte;
-                            read_success = 1;
-                            currentState = CHECK_BCC2;
-                        }
-                        else {
-                            stuffed_payload[p] = byte;
-                            buf[i] = byte;
-                            p++;
-                            i++;
-                        }
-                        break;
-
-                    case CHECK_BCC2:
-                        destuf_size = destuffing(stuffed_payload, destuffed_payload, p);
-                        int bcc2 = buildBCC2(destuffed_payload, destuf_size - 1);
-
-                        if (bcc2 == destuffed_payload[destuf_size-1]) currentState = BCC2_OK;
-                        else {
-                            i = 0;
-                            currentState = START;
-                            read_success = 0;
-                            stop = 1;
-                            printf("Packet reject. Retransmiting\n");
-                            sendSup(fd, A_REC, REJECT(tramaRc)); //send reject
-                        }
-                        break;
-
-                    case BCC2_OK:
-                        if (byte == FLAG) {
-                            buf[i] = byte;
-                            i++;
-                            currentState = STOP_MACHINE;
-                        }
-                        else {
-                            currentState = START;
-                            startOver = 1;
-                            i = 0;
-                        }
-                        break;
-
-                    case STOP_MACHINE:
-                        sendSup(fd, A_TR, RR(tramaRc)); // send rr
-                        tramaRc = (tramaRc + 1)%2;
-                        read_success = 0;
-                        stop = 1;
-                        STOP = TRUE;
-                        break;
-
-                    case STOP_MACHINE_DISC:
-                        sendSup(fd, A_REC, c_b); // send disc
-                        read_success = 0;
-                        stop = 1;
-                        STOP = TRUE;
-                        break;
-
-                    default:
-                        break;
-                }
-            }
-        }
+// Copies the counters, called with the connection locked.
+void collectStatistics(LinkConnection* conn, LinkStatistics* statistics) {
+    statistics->maxFramePayload = conn->maxPayload;
+    statistics->extendedFrames = conn->extendedFrames;
+    statistics->lineBps = conn->lineBps;
+    statistics->elapsed = (nowMs() - conn->openedAt) / 1000;
+    statistics->framesSent = conn->framesSent;
+    statistics->retransmissions = conn->retransmissions;
+    statistics->framesReceived = conn->framesReceived;
+    statistics->duplicates = conn->duplicates;
+    statistics->rejSent = conn->rejectsSent;
+    statistics->rejReceived = conn->rejReceived;
+    statistics->timeouts = conn->timeouts;
+    statistics->fecRepaired = conn->fecRepaired;
+    statistics->dataSent = conn->dataSent;
+    statistics->dataReceived = conn->dataReceived;
+    statistics->lineBytesSent = conn->lineBytesSent;
+    statistics->stuffingBytes = conn->stuffingBytes;
+    memcpy(statistics->ackLatency, conn->ackLatency, sizeof(conn->ackLatency));
+    memcpy(statistics->writeLatency, conn->writeLatency, sizeof(conn->writeLatency));
+}
+
+void printHistogram(const char* name, const long* histogram) {
+    int last = LATENCY_BUCKETS - 1;
+    while (last >= 0 && histogram[last] == 0) last--;
+    if (last < 0) return;
+    printf("%s latency (ms):", name);
+    for (int i = 0; i <= last; i++) {
+        if (i == 0) printf(" <1: %ld", histogram[i]);
+        else if (i == LATENCY_BUCKETS - 1) printf(" >=%d: %ld", 1 << (i - 1), histogram[i]);
+        else printf(" %d-%d: %ld", 1 << (i - 1), 1 << i, histogram[i]);
     }
+    printf("\n");
+}
 
-    for (int j = 0; j < destuf_size; j++) packet[j] = destuffed_payload[j];
+// Efficiency is the data carried over what the line could carry in the same time,
+// lineBps / 10 bytes per second with 8N1. The baud rate is only the one configured: when
+// more than that went through either way, as on pseudo terminals, the real rate is unknown.
+void printEfficiency(const char* name, long data, double capacity, int faster, int lineBps) {
+    if (capacity <= 0) return;
+    if (faster) printf("  Efficiency %s: unknown, the line is faster than %d baud\n", name, lineBps);
+    else printf("  Efficiency %s: %.1f%% of %d baud\n", name, 100 * data / capacity, lineBps);
+}
 
-    return destuf_size;
+void printStatistics(const LinkStatistics* statistics) {
+    double capacity = statistics->elapsed * statistics->lineBps / 10;
+    int faster = statistics->lineBytesSent > capacity || statistics->dataReceived > capacity;
+    printf("Link statistics (%.3f s at %d baud):\n", statistics->elapsed, statistics->lineBps);
+    printf("  I-frames sent: %ld, retransmissions: %ld, received: %ld, duplicates: %ld\n",
+           statistics->framesSent, statistics->retransmissions, statistics->framesReceived, statistics->duplicates);
+    printf("  REJ sent: %ld, received: %ld, timeouts: %ld, FEC repairs: %ld\n",
+           statistics->rejSent, statistics->rejReceived, statistics->timeouts, statistics->fecRepaired);
+    if (statistics->framesSent > 0) {
+        printf("  Data sent: %ld bytes, %ld bytes on the line, %ld of them stuffing\n",
+               statistics->dataSent, statistics->lineBytesSent, statistics->stuffingBytes);
+        printEfficiency("sending", statistics->dataSent, capacity, faster, statistics->lineBps);
+    }
+    if (statistics->framesReceived > 0) {
+        printf("  Data received: %ld bytes\n", statistics->dataReceived);
+        printEfficiency("receiving", statistics->dataReceived, capacity, faster, statistics->lineBps);
+    }
+    printHistogram("  Ack", statistics->ackLatency);
+    printHistogram("  llwrite", statistics->writeLatency);
 }
 
-////////////////////////////////////////////////
-// LLCLOSE
-////////////////////////////////////////////////
-int llclose(int fd, int showStatistics) {
-    enum States currentState = START;
-    (void)signal(SIGALRM, alarmHandler);
-    
+// Prints the statistics if asked and releases the connection.
+int closeConnection(LinkConnection* conn, int showStatistics) {
+    if (showStatistics) {
+        LinkStatistics statistics;
+        collectStatistics(conn, &statistics);
+        printStatistics(&statistics);
+    }
+    return freeConnection(conn);
+}
+
+int llcloseConnection(LinkConnection* conn, int showStatistics) {
+    int delivered;
+
+    pthread_mutex_lock(&conn->lock);
+
+    // the DISC was answered when it arrived, only the final UA is left
+    if (conn->role == LlRx) {
+        if (conn->discReceived) {
+            int timeouts = conn->timeouts;
+            startTimer(conn);
+            while (!conn->uaReceived && conn->timeouts == timeouts && !conn->failed) pump(conn, NULL, &delivered);
+        }
+        while (conn->users > 0) pthread_cond_wait(&conn->changed, &conn->lock);
+        return closeConnection(conn, showStatistics);
+    }
+
+    // every frame in the window must be acknowledged first
+    if (waitAcks(conn, 0) < 0) {
+        printf("Retransmissions exceeded\n");
+        failConnection(conn);
+        while (conn->users > 0) pthread_cond_wait(&conn->changed, &conn->lock);
+        closeConnection(conn, showStatistics);
+        return -1;
+    }
+
     // mandar disc
     unsigned char disc_buf[5];
     disc_buf[0] = FLAG;
@@ -565,51 +1427,50 @@ int llclose(int fd, int showStatistics) {
     disc_buf[3] = disc_buf[1] ^ disc_buf[2];
     disc_buf[4] = FLAG;
 
-    sendFrame(fd, disc_buf, 5); // send connection set
+    conn->timeoutCount = 0;
+    sendFrame(conn, disc_buf, 5);
 
     // receber disc
-    unsigned char byte;
-    int stop = 0;
-
-    while (stop == 0) {
-        if (read(fd, &byte, 1)) {
-            switch (currentState) {
-                case START:
-                    if (byte == FLAG) currentState = FLAG_RCV;
-                    break;
-
-                case FLAG_RCV:
-                    if (byte == A_REC) currentState = A_RCV;
-                    else if (byte != FLAG) currentState = START;
-                    break;
-
-                case A_RCV:
-                    if (byte == C_DISC) currentState = C_RCV;
-                    else if (byte == FLAG) currentState = FLAG_RCV;
-                    else currentState = START;
-                    break;
-
-                case C_RCV:
-                    if (byte == (A_REC ^ C_DISC)) currentState = BCC1_OK;
-                    else if (byte == FLAG) currentState = FLAG_RCV;
-                    else currentState = START;
-                    break;
-
-                case BCC1_OK:
-                    if (byte == FLAG) stop = 1;
-                    else currentState = START;
-                    break;
-
-                default:
-                    break;
-            }
+    int timeouts = conn->timeouts;
+    while (!conn->discReceived) {
+        if (conn->failed || conn->timeoutCount >= conn->nRetransmissions) {
+            failConnection(conn);
+            while (conn->users > 0) pthread_cond_wait(&conn->changed, &conn->lock);
+            closeConnection(conn, showStatistics);
+            return -1;
+        }
+        pump(conn, NULL, &delivered);
+        if (conn->timeouts != timeouts && !conn->discReceived) {
+            timeouts = conn->timeouts;
+            sendFrame(conn, disc_buf, 5);
         }
     }
 
     // mandar ua_disc
-    if (stop != 1) return -1;
-    sendSup(fd, A_TR, C_UA);
-    alarm(0);
+    sendSup(conn->fd, A_TR, C_UA);
+    stopTimer(conn);
+
+    // calls still waiting on this connection return now that it is closed
+    while (conn->users > 0) pthread_cond_wait(&conn->changed, &conn->lock);
+    return closeConnection(conn, showStatistics);
+}
+
+int llclose(int fd, int showStatistics) {
+    LinkConnection* conn = findConnection(fd, TRUE);
+    return conn != NULL ? llcloseConnection(conn, showStatistics) : -1;
+}
+
+////////////////////////////////////////////////
+// LLSTATISTICS
+////////////////////////////////////////////////
+int llstatisticsConnection(LinkConnection* conn, LinkStatistics* statistics) {
+    pthread_mutex_lock(&conn->lock);
+    collectStatistics(conn, statistics);
+    pthread_mutex_unlock(&conn->lock);
+    return 1;
+}
 
-    return close(fd);
+int llstatistics(int fd, LinkStatistics* statistics) {
+    LinkConnection* conn = findConnection(fd, FALSE);
+    return conn != NULL ? llstatisticsConnection(conn, statistics) : -1;
 }
@@ -0,0 +1,120 @@
+// Byte stuffing engine.
+// Scans 16 / 32 bytes at a time for FLAG / ESC and bulk-copies the clean runs.
+// The kernel is chosen on first use from the features of the CPU.
+
+#include "stuffing.h"
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define STUFF_X86 1
+#endif
+
+typedef int (*StuffKernel)(const unsigned char *in, int n, unsigned char *out);
+
+static int stuffScalar(const unsigned char *in, int n, unsigned char *out) {
+    int pos = 0;
+    int run = 0;
+
+    for (int i = 0; i < n; i++) {
+        if (in[i] == STUFF_FLAG || in[i] == STUFF_ESC) {
+            memcpy(out + pos, in + run, i - run);
+            pos += i - run;
+            out[pos++] = STUFF_ESC;
+            out[pos++] = in[i] ^ 0x20;
+            run = i + 1;
+        }
+    }
+    memcpy(out + pos, in + run, n - run);
+    return pos + n - run;
+}
+
+#ifdef STUFF_X86
+
+// Copies a block whose FLAG / ESC positions are set in "mask", escaping them.
+static inline int stuffBlock(const unsigned char *in, int size, unsigned int mask, unsigned char *out) {
+    int pos = 0;
+    int run = 0;
+
+    while (mask) {
+        int k = __builtin_ctz(mask);
+        memcpy(out + pos, in + run, k - run);
+        pos += k - run;
+        out[pos++] = STUFF_ESC;
+        out[pos++] = in[k] ^ 0x20;
+        run = k + 1;
+        mask &= mask - 1;
+    }
+    memcpy(out + pos, in + run, size - run);
+    return pos + size - run;
+}
+
+__attribute__((target("sse2")))
+static int stuffSSE2(const unsigned char *in, int n, unsigned char *out) {
+    const __m128i flag = _mm_set1_epi8((char)STUFF_FLAG);
+    const __m128i esc = _mm_set1_epi8((char)STUFF_ESC);
+    int pos = 0;
+    int i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+        unsigned int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, flag), _mm_cmpeq_epi8(v, esc)));
+        if (mask == 0) {
+            _mm_storeu_si128((__m128i *)(out + pos), v);
+            pos += 16;
+        }
+        else pos += stuffBlock(in + i, 16, mask, out + pos);
+    }
+    return pos + stuffScalar(in + i, n - i, out + pos);
+}
+
+__attribute__((target("avx2")))
+static int stuffAVX2(const unsigned char *in, int n, unsigned char *out) {
+    const __m256i flag = _mm256_set1_epi8((char)STUFF_FLAG);
+    const __m256i esc = _mm256_set1_epi8((char)STUFF_ESC);
+    int pos = 0;
+    int i = 0;
+
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(in + i));
+        unsigned int mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, flag), _mm256_cmpeq_epi8(v, esc)));
+        if (mask == 0) {
+            _mm256_storeu_si256((__m256i *)(out + pos), v);
+            pos += 32;
+        }
+        else pos += stuffBlock(in + i, 32, mask, out + pos);
+    }
+    return pos + stuffSSE2(in + i, n - i, out + pos);
+}
+
+#endif
+
+static StuffKernel kernel = NULL;
+static const char *kernelName = "scalar";
+static pthread_once_t kernelOnce = PTHREAD_ONCE_INIT;
+
+static void selectKernel() {
+    kernel = stuffScalar;
+#ifdef STUFF_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        kernel = stuffAVX2;
+        kernelName = "avx2";
+    }
+    else if (__builtin_cpu_supports("sse2")) {
+        kernel = stuffSSE2;
+        kernelName = "sse2";
+    }
+#endif
+}
+
+int stuffBytes(const unsigned char *in, int n, unsigned char *out) {
+    pthread_once(&kernelOnce, selectKernel);
+    return kernel(in, n, out);
+}
+
+const char *stuffKernelName() {
+    pthread_once(&kernelOnce, selectKernel);
+    return kernelName;
+}